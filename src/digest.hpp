@@ -0,0 +1,165 @@
+//
+//  digest.hpp
+//
+//  Created by Ismo Kärkkäinen on 18.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+// Hash of what would be written to a file, stored in an extended attribute
+// of the file so that writing the same output again can be skipped.
+
+#if !defined(DIGEST_HPP)
+#define DIGEST_HPP
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <charconv>
+#include <system_error>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+
+inline std::uint64_t digest_rotl(std::uint64_t Value, int Bits) {
+    return (Value << Bits) | (Value >> (64 - Bits));
+}
+
+inline std::uint64_t digest_read(const unsigned char* Src) {
+    std::uint64_t v;
+    memcpy(&v, Src, sizeof(v));
+    return v;
+}
+
+// 64-bit xxHash of Length bytes in host byte order. The four independent
+// accumulators of the main loop keep the multipliers busy.
+inline std::uint64_t digest(const void* Data, size_t Length,
+    std::uint64_t Seed = 0)
+{
+    const std::uint64_t p1 = 0x9E3779B185EBCA87ULL, p2 = 0xC2B2AE3D27D4EB4FULL,
+        p3 = 0x165667B19E3779F9ULL, p4 = 0x85EBCA77C2B2AE63ULL,
+        p5 = 0x27D4EB2F165667C5ULL;
+    auto round = [&](std::uint64_t Acc, std::uint64_t Value) {
+        return digest_rotl(Acc + Value * p2, 31) * p1;
+    };
+    const unsigned char* src = static_cast<const unsigned char*>(Data);
+    const unsigned char* const end = src + Length;
+    std::uint64_t h;
+    if (32 <= Length) {
+        std::uint64_t v[4] = { Seed + p1 + p2, Seed + p2, Seed, Seed - p1 };
+        for (; src + 32 <= end; src += 32)
+            for (int k = 0; k < 4; ++k)
+                v[k] = round(v[k], digest_read(src + 8 * k));
+        h = digest_rotl(v[0], 1) + digest_rotl(v[1], 7) +
+            digest_rotl(v[2], 12) + digest_rotl(v[3], 18);
+        for (int k = 0; k < 4; ++k)
+            h = (h ^ round(0, v[k])) * p1 + p4;
+    } else
+        h = Seed + p5;
+    h += Length;
+    for (; src + 8 <= end; src += 8)
+        h = digest_rotl(h ^ round(0, digest_read(src)), 27) * p1 + p4;
+    if (src + 4 <= end) {
+        std::uint32_t v;
+        memcpy(&v, src, sizeof(v));
+        h = digest_rotl(h ^ (v * p1), 23) * p2 + p3;
+        src += 4;
+    }
+    for (; src < end; ++src)
+        h = digest_rotl(h ^ (*src * p5), 11) * p1;
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    return h ^ (h >> 32);
+}
+
+// Attribute that holds the digest of the output, file size and modification
+// time in seconds and nanoseconds, as hexadecimal text separated by spaces.
+static const char* const digest_attribute = "user.fileio.digest";
+
+// Gets size and modification time of Filename to State, so that a digest is
+// not trusted after another program changes the file. Change time would not
+// do as storing the digest changes it.
+inline bool digest_file_state(const std::string& Filename,
+    std::uint64_t* State)
+{
+    struct stat st;
+    if (stat(Filename.c_str(), &st) != 0)
+        return false;
+    State[0] = static_cast<std::uint64_t>(st.st_size);
+#if defined(__APPLE__)
+    State[1] = static_cast<std::uint64_t>(st.st_mtimespec.tv_sec);
+    State[2] = static_cast<std::uint64_t>(st.st_mtimespec.tv_nsec);
+#else
+    State[1] = static_cast<std::uint64_t>(st.st_mtim.tv_sec);
+    State[2] = static_cast<std::uint64_t>(st.st_mtim.tv_nsec);
+#endif
+    return true;
+}
+
+// Returns true if Filename has Value as its stored digest and has not changed
+// since it was stored.
+inline bool digest_matches(const std::string& Filename, std::uint64_t Value) {
+    char text[80];
+#if defined(__APPLE__)
+    ssize_t len = getxattr(Filename.c_str(), digest_attribute, text,
+        sizeof(text), 0, 0);
+#else
+    ssize_t len = getxattr(Filename.c_str(), digest_attribute, text,
+        sizeof(text));
+#endif
+    std::uint64_t current[4] = { Value };
+    if (len <= 0 || !digest_file_state(Filename, current + 1))
+        return false;
+    const char* src = text;
+    const char* const end = text + len;
+    for (int k = 0; k < 4; ++k) {
+        if (k && (src == end || *src++ != ' '))
+            return false;
+        std::uint64_t stored = 0;
+        auto result = std::from_chars(src, end, stored, 16);
+        if (result.ec != std::errc() || stored != current[k])
+            return false;
+        src = result.ptr;
+    }
+    return src == end;
+}
+
+// Stores Value as the digest of Filename, once it has been written. Failure
+// leaves none stored.
+inline void store_digest(const std::string& Filename, std::uint64_t Value) {
+    std::uint64_t values[4] = { Value };
+    char text[80];
+    char* end = text;
+    bool ok = digest_file_state(Filename, values + 1);
+    for (int k = 0; ok && k < 4; ++k) {
+        if (k)
+            *end++ = ' ';
+        end = std::to_chars(end, text + sizeof(text), values[k], 16).ptr;
+    }
+#if defined(__APPLE__)
+    int rv = ok ? setxattr(Filename.c_str(), digest_attribute, text,
+        end - text, 0, 0) : -1;
+    if (rv != 0)
+        removexattr(Filename.c_str(), digest_attribute, 0);
+#else
+    int rv = ok ? setxattr(Filename.c_str(), digest_attribute, text,
+        end - text, 0) : -1;
+    if (rv != 0)
+        removexattr(Filename.c_str(), digest_attribute);
+#endif
+}
+
+// Removes the stored digest, for output written without one.
+inline void forget_digest(const std::string& Filename) {
+#if defined(__APPLE__)
+    removexattr(Filename.c_str(), digest_attribute, 0);
+#else
+    removexattr(Filename.c_str(), digest_attribute);
+#endif
+}
+
+#endif
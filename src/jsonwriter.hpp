@@ -0,0 +1,75 @@
+//
+//  jsonwriter.hpp
+//
+//  Created by Ismo Kärkkäinen on 18.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+// Output of large arrays as JSON, formatted by several threads.
+
+#if !defined(JSONWRITER_HPP)
+#define JSONWRITER_HPP
+
+#include "parallel.hpp"
+#include "sink.hpp"
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <cstddef>
+#include <sys/uio.h>
+
+
+// Writes {"Names[0]":Arrays[0],...} followed by a newline to fd. Arrays are
+// cut into pieces of rows so that all threads have work even when there are
+// fewer arrays than threads. Format(Stream, Row, Buffer) formats one row.
+// Pieces are formatted in parallel and written in order with writev.
+// Returns false on write error.
+template<typename Array, typename Formatter>
+bool write_arrays(int fd, const std::vector<std::string>& Names,
+    const std::vector<Array>& Arrays, ThreadPool& Pool, Formatter Format)
+{
+    struct Piece {
+        size_t array, begin, end;
+        std::string text;
+    };
+    std::vector<Piece> pieces;
+    const size_t per_array = Arrays.empty() ? 1 :
+        (4 * Pool.Size() + Arrays.size() - 1) / Arrays.size();
+    for (size_t k = 0; k < Arrays.size(); ++k) {
+        const size_t rows = Arrays[k].size();
+        const size_t count = std::max(size_t(1), std::min(rows, per_array));
+        for (size_t p = 0; p < count; ++p)
+            pieces.push_back(Piece {
+                k, (rows * p) / count, (rows * (p + 1)) / count, "" });
+    }
+    Pool.Ranges(pieces.size(), 1, [&](size_t Part, size_t Begin, size_t End) {
+        std::vector<char> buffer(256, 0);
+        for (size_t n = Begin; n < End; ++n) {
+            Piece& piece = pieces[n];
+            const Array& array = Arrays[piece.array];
+            std::ostringstream out;
+            if (piece.begin == 0)
+                out << (piece.array ? "," : "") << '"' << Names[piece.array]
+                    << "\":[";
+            for (size_t r = piece.begin; r < piece.end; ++r) {
+                if (r)
+                    out << ',';
+                Format(out, array[r], buffer);
+            }
+            if (piece.end == array.size())
+                out << ']';
+            piece.text = out.str();
+        }
+    });
+    char open[] = "{", close[] = "}\n";
+    std::vector<iovec> parts;
+    parts.push_back(iovec { open, 1 });
+    for (auto& piece : pieces)
+        parts.push_back(iovec { &piece.text[0], piece.text.size() });
+    parts.push_back(iovec { close, 2 });
+    return writev_all(fd, parts);
+}
+
+#endif
@@ -11,9 +11,19 @@
 #include <cinttypes>
 #if !defined(NO_PNG)
 #include <cstring>
-#include <memory>
-#include <csetjmp>
-#include <png.h>
+#include <cstdlib>
+#include <algorithm>
+#include <limits>
+#include <zlib.h>
+#endif
+#if defined(UNITTEST)
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest/doctest.h"
+#endif
+#if defined(BENCHMARK)
+#include <iostream>
+#include <chrono>
+#include <random>
 #endif
 
 
@@ -35,88 +45,549 @@ public:
 };
 
 #if !defined(NO_PNG)
-static void png_error_handler(png_structp unused, const char* error) {
-    throw error;
-}
 
-static void png_warning_handler(png_structp unused, const char* unused2) { }
+// PNG is written here directly so that IDAT contents can be compressed in
+// parallel: filtered scanlines are split into parts that are deflated
+// independently, using the end of the previous part as dictionary. Parts
+// other than the last end with a sync flush so that the raw deflate streams
+// can be concatenated after a zlib header and followed by the Adler-32 of
+// all data.
 
-typedef void (*png_destroyer)(png_structp);
-static void destroy_png(png_structp p) {
-    png_destroy_write_struct(&p, nullptr);
+static inline unsigned int paeth(unsigned int A, unsigned int B, unsigned int C)
+{
+    int p = int(A) + int(B) - int(C);
+    int pa = std::abs(p - int(A));
+    int pb = std::abs(p - int(B));
+    int pc = std::abs(p - int(C));
+    if (pa <= pb && pa <= pc)
+        return A;
+    return (pb <= pc) ? B : C;
 }
 
-typedef void (*info_destroyer)(png_infop);
-static png_structp png_s = nullptr;
-static void destroy_info(png_infop p) {
-    png_destroy_info_struct(png_s, &p);
+// Filter type value that means choosing the filter for each row separately.
+static const int AdaptiveFilter = 5;
+
+// Filters Row into Dst with filter type Filter. Prev is the previous row, or
+// zeros for the first row. Returns the sum of absolute values of the result
+// as signed bytes.
+static std::uint64_t apply_filter(int Filter, unsigned char* Dst,
+    const unsigned char* Row, const unsigned char* Prev, size_t Length,
+    size_t Bpp)
+{
+    size_t k = 0;
+    switch (Filter) {
+    case 0:
+        memcpy(Dst, Row, Length);
+        break;
+    case 1:
+        for (; k < Bpp; ++k)
+            Dst[k] = Row[k];
+        for (; k < Length; ++k)
+            Dst[k] = static_cast<unsigned char>(Row[k] - Row[k - Bpp]);
+        break;
+    case 2:
+        for (; k < Length; ++k)
+            Dst[k] = static_cast<unsigned char>(Row[k] - Prev[k]);
+        break;
+    case 3:
+        for (; k < Bpp; ++k)
+            Dst[k] = static_cast<unsigned char>(Row[k] - (Prev[k] >> 1));
+        for (; k < Length; ++k)
+            Dst[k] = static_cast<unsigned char>(
+                Row[k] - ((unsigned(Row[k - Bpp]) + Prev[k]) >> 1));
+        break;
+    case 4:
+        for (; k < Bpp; ++k)
+            Dst[k] = static_cast<unsigned char>(Row[k] - Prev[k]);
+        for (; k < Length; ++k)
+            Dst[k] = static_cast<unsigned char>(Row[k] -
+                paeth(Row[k - Bpp], Prev[k], Prev[k - Bpp]));
+        break;
+    }
+    std::uint64_t sum = 0;
+    for (k = 0; k < Length; ++k)
+        sum += (Dst[k] < 128) ? Dst[k] : 256 - Dst[k];
+    return sum;
 }
 
-static void append(png_structp Png, png_bytep Data, size_t Length) {
-    if (Length == 0)
+// Writes filter type byte and filtered row to Dst. Adaptive filter picks
+// the one with the minimum sum of absolute differences, as libpng does.
+static void filter_row(int Filter, unsigned char* Dst, const unsigned char* Row,
+    const unsigned char* Prev, size_t Length, size_t Bpp)
+{
+    if (Filter != AdaptiveFilter) {
+        Dst[0] = static_cast<unsigned char>(Filter);
+        apply_filter(Filter, Dst + 1, Row, Prev, Length, Bpp);
         return;
-    std::vector<unsigned char>* out =
-        reinterpret_cast<std::vector<unsigned char>*>(png_get_io_ptr(Png));
-    out->resize(out->size() + Length);
-    memcpy(&(out->front()) + (out->size() - Length), Data, Length);
+    }
+    thread_local std::vector<unsigned char> trial[5];
+    int best = 0;
+    std::uint64_t best_sum = ~std::uint64_t(0);
+    for (int f = 0; f < 5; ++f) {
+        trial[f].resize(Length);
+        std::uint64_t sum = apply_filter(f, trial[f].data(), Row, Prev,
+            Length, Bpp);
+        if (sum < best_sum) {
+            best_sum = sum;
+            best = f;
+        }
+    }
+    Dst[0] = static_cast<unsigned char>(best);
+    memcpy(Dst + 1, trial[best].data(), Length);
+}
+
+// Raw deflate of Data, primed with Dictionary if given. Ends with sync flush
+// unless Last, in which case the final block is marked.
+static bool deflate_part(std::vector<unsigned char>& Out,
+    const unsigned char* Dictionary, size_t DictionaryLength,
+    const unsigned char* Data, size_t Length, bool Last, int Level,
+    int Strategy)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Level, Z_DEFLATED, -15, 8, Strategy) != Z_OK)
+            return false;
+    if (DictionaryLength && deflateSetDictionary(&z, Dictionary,
+        static_cast<uInt>(DictionaryLength)) != Z_OK)
+    {
+        deflateEnd(&z);
+        return false;
+    }
+    Out.resize(deflateBound(&z, static_cast<uLong>(Length)) + 16);
+    z.next_in = const_cast<Bytef*>(Data);
+    z.avail_in = static_cast<uInt>(Length);
+    int status;
+    do {
+        if (z.total_out == Out.size())
+            Out.resize(2 * Out.size());
+        z.next_out = &Out[z.total_out];
+        z.avail_out = static_cast<uInt>(Out.size() - z.total_out);
+        status = deflate(&z, Last ? Z_FINISH : Z_SYNC_FLUSH);
+    } while (Last ? (status == Z_OK || status == Z_BUF_ERROR) :
+        (status == Z_OK && z.avail_out == 0));
+    bool ok = Last ? (status == Z_STREAM_END) : (status == Z_OK);
+    Out.resize(z.total_out);
+    deflateEnd(&z);
+    return ok;
+}
+
+struct PNGEncoding {
+    int filter, level, strategy;
+};
+
+// Picks filter type and zlib level and strategy for Profile by compressing a
+// sample of rows with candidate settings in parallel. Sample is blocks of
+// consecutive rows so that matches with previous rows are seen. Rows are
+// RowSize apart in Raw and Zero is a row of zeros.
+static PNGEncoding choose_encoding(PNGProfile Profile, ThreadPool& Pool,
+    const unsigned char* Raw, const unsigned char* Zero, size_t Height,
+    size_t RowSize, size_t Bpp)
+{
+    const size_t blocks = 4, block = 4;
+    const size_t samples = std::min(Height, blocks * block);
+    const size_t line_size = RowSize + 1;
+    std::vector<unsigned char> filtered[AdaptiveFilter + 1];
+    std::uint64_t sums[5] = { 0, 0, 0, 0, 0 };
+    for (auto& f : filtered)
+        f.resize(samples * line_size);
+    for (size_t s = 0; s < samples; ++s) {
+        size_t r = s;
+        if (samples == blocks * block)
+            r = ((Height - block) * (s / block)) / (blocks - 1) + s % block;
+        const unsigned char* row = Raw + r * RowSize;
+        const unsigned char* prev = r ? row - RowSize : Zero;
+        for (int f = 0; f < 5; ++f) {
+            filtered[f][s * line_size] = static_cast<unsigned char>(f);
+            sums[f] += apply_filter(f, &filtered[f][s * line_size + 1],
+                row, prev, RowSize, Bpp);
+        }
+        filter_row(AdaptiveFilter, &filtered[AdaptiveFilter][s * line_size],
+            row, prev, RowSize, Bpp);
+    }
+    // Cheaper settings come first so that they win ties.
+    std::vector<PNGEncoding> candidates;
+    switch (Profile) {
+    case PNGSpeed: {
+        // One filter, the one with the smallest differences.
+        int fixed = 0;
+        for (int f = 1; f < 5; ++f)
+            if (sums[f] < sums[fixed])
+                fixed = f;
+        candidates.push_back({ fixed, 1, Z_RLE });
+        candidates.push_back({ fixed, 1, Z_DEFAULT_STRATEGY });
+        break;
+    }
+    case PNGBalanced:
+        for (int f = 0; f <= AdaptiveFilter; ++f) {
+            candidates.push_back({ f, Z_DEFAULT_COMPRESSION, Z_RLE });
+            candidates.push_back(
+                { f, Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY });
+        }
+        break;
+    case PNGSize:
+        for (int f = 0; f <= AdaptiveFilter; ++f) {
+            candidates.push_back({ f, Z_BEST_COMPRESSION, Z_RLE });
+            candidates.push_back({ f, Z_BEST_COMPRESSION, Z_FILTERED });
+            candidates.push_back(
+                { f, Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY });
+        }
+        break;
+    }
+    std::vector<size_t> sizes(candidates.size(), ~size_t(0));
+    Pool.Ranges(candidates.size(), 1,
+        [&](size_t Part, size_t Begin, size_t End) {
+            std::vector<unsigned char> out;
+            for (size_t k = Begin; k < End; ++k) {
+                const PNGEncoding& c = candidates[k];
+                if (deflate_part(out, nullptr, 0, filtered[c.filter].data(),
+                    filtered[c.filter].size(), true, c.level, c.strategy))
+                        sizes[k] = out.size();
+            }
+        });
+    size_t best = 0;
+    for (size_t k = 1; k < candidates.size(); ++k)
+        if (sizes[k] < sizes[best])
+            best = k;
+    return candidates[best];
+}
+
+// Parts of whole lines, at least 128 KiB each, as in pigz.
+static const size_t part_bytes = size_t(128) << 10;
+
+PNGEncoder::PNGEncoder(ByteSink& Out, size_t Width, size_t Height,
+    size_t Components, int Depth, const Quantizer& Q, ThreadPool& Pool,
+    PNGProfile Profile)
+    : out(Out), q(Q), pool(Pool), profile(Profile), width(Width),
+    height(Height), components(Components), rows(0), depth(Depth), filter(0),
+    level(Z_DEFAULT_COMPRESSION), strategy(Z_DEFAULT_STRATEGY), checksum(1),
+    started(false), compressed(0)
+{ }
+
+bool PNGEncoder::write_chunk(const char* Type, const unsigned char* Data,
+    size_t Length)
+{
+    Buffer<unsigned char> head, crc;
+    head.write_u32(static_cast<std::uint32_t>(Length));
+    head.insert(head.end(), Type, Type + 4);
+    uLong sum = crc32(0, &head[4], 4);
+    if (Length)
+        sum = crc32(sum, Data, static_cast<uInt>(Length));
+    crc.write_u32(static_cast<std::uint32_t>(sum));
+    return out.Write(head.data(), head.size()) &&
+        (Length == 0 || out.Write(Data, Length)) &&
+        out.Write(crc.data(), crc.size());
+}
+
+// IHDR contents. Compression, filter and interlace methods are 0.
+static Buffer<unsigned char> header_data(size_t Width, size_t Height,
+    int Depth, unsigned char ColorType)
+{
+    Buffer<unsigned char> header;
+    header.write_u32(static_cast<std::uint32_t>(Width))
+        .write_u32(static_cast<std::uint32_t>(Height))
+        << static_cast<unsigned char>(Depth) << ColorType << 0 << 0 << 0;
+    return header;
+}
+
+static unsigned char color_type(size_t Components) {
+    switch (Components) {
+    case 1: return 0; // Gray.
+    case 2: return 4; // Gray and alpha.
+    case 3: return 2; // RGB.
+    case 4: return 6; // RGB and alpha.
+    }
+    return 255;
+}
+
+// Chooses encoding using Rows packed rows in Sample, preceded by a row of
+// zeros, and writes signature and header.
+bool PNGEncoder::start(const unsigned char* Sample, size_t Rows) {
+    if (color_type(components) == 255 ||
+        std::numeric_limits<std::uint32_t>::max() < width)
+            return false;
+    const size_t bpp = components * (depth / 8);
+    PNGEncoding enc = choose_encoding(profile, pool, Sample,
+        Sample - width * bpp, Rows, width * bpp, bpp);
+    filter = enc.filter;
+    level = enc.level;
+    strategy = enc.strategy;
+    started = true;
+    const unsigned char signature[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    Buffer<unsigned char> header = header_data(width, height, depth,
+        color_type(components));
+    return out.Write(signature, sizeof(signature)) &&
+        write_chunk("IHDR", header.data(), header.size());
+}
+
+// Deflates whole parts of filtered data not yet compressed, or all of it if
+// Last, and writes one IDAT per part. First has the zlib header, last the
+// checksum. Keeps the end of the data as dictionary for the next part.
+bool PNGEncoder::deflate_parts(bool Last) {
+    const size_t line_size = width * components * (depth / 8) + 1;
+    const size_t part_length =
+        std::max(size_t(1), part_bytes / line_size) * line_size;
+    const size_t pending = filtered.size() - compressed;
+    size_t parts = pending / part_length;
+    if (Last)
+        parts = std::max(size_t(1), (pending + part_length - 1) / part_length);
+    if (parts == 0)
+        return true;
+    auto length = [&](size_t Part) {
+        return std::min(part_length, pending - Part * part_length);
+    };
+    std::vector<std::vector<unsigned char>> data(parts);
+    std::vector<uLong> checksums(parts);
+    std::vector<char> ok(parts, 0);
+    pool.Ranges(parts, 1, [&](size_t Part, size_t Begin, size_t End) {
+        for (size_t k = Begin; k < End; ++k) {
+            size_t start = compressed + k * part_length;
+            size_t dict = std::min(size_t(32768), start);
+            ok[k] = deflate_part(data[k], filtered.data() + start - dict, dict,
+                filtered.data() + start, length(k), Last && k + 1 == parts,
+                level, strategy);
+            checksums[k] = adler32(1, filtered.data() + start,
+                static_cast<uInt>(length(k)));
+        }
+    });
+    for (size_t k = 0; k < parts; ++k) {
+        if (!ok[k])
+            return false;
+        checksum = static_cast<std::uint32_t>(adler32_combine(checksum,
+            checksums[k], static_cast<z_off_t>(length(k))));
+    }
+    for (size_t k = 0; k < parts; ++k) {
+        if (compressed == 0 && k == 0) {
+            // Compression level hint in the header is informative only.
+            const unsigned char zlib_header[] = { 0x78,
+                static_cast<unsigned char>((level == 1) ? 0x01 :
+                    ((level == Z_BEST_COMPRESSION) ? 0xda : 0x9c)) };
+            data[k].insert(data[k].begin(), zlib_header, zlib_header + 2);
+        }
+        if (Last && k + 1 == parts) {
+            Buffer<unsigned char> adler;
+            adler.write_u32(checksum);
+            data[k].insert(data[k].end(), adler.begin(), adler.end());
+        }
+        if (!write_chunk("IDAT", data[k].data(), data[k].size()))
+            return false;
+        data[k] = std::vector<unsigned char>();
+    }
+    size_t end = Last ? filtered.size() : compressed + parts * part_length;
+    size_t keep = std::min(size_t(32768), end);
+    filtered.erase(filtered.begin(), filtered.begin() + (end - keep));
+    compressed = keep;
+    return true;
+}
+
+bool PNGEncoder::Append(
+    const std::vector<std::vector<std::vector<float>>>& Image,
+    size_t Begin, size_t End)
+{
+    const size_t bpp = components * (depth / 8);
+    const size_t row_size = width * bpp;
+    const size_t line_size = row_size + 1;
+    // Enough lines for each thread to deflate two parts.
+    const size_t batch = 2 * pool.Size() *
+        std::max(size_t(1), part_bytes / line_size);
+    if (raw.empty())
+        raw.resize(row_size, 0);
+    for (size_t first = Begin; first < End;) {
+        size_t count = std::min(batch, End - first);
+        raw.resize((count + 1) * row_size);
+        q.pack_rows(pool, (depth == 8) ? &Quantizer::pack8 :
+            &Quantizer::pack16be, &raw[row_size], row_size, Image, first,
+            first + count);
+        if (!started && !start(&raw[row_size], count))
+            return false;
+        size_t at = filtered.size();
+        filtered.resize(at + count * line_size);
+        pool.Ranges(count, 1, [&](size_t Part, size_t Begin, size_t End) {
+            for (size_t r = Begin; r < End; ++r)
+                filter_row(filter, &filtered[at + r * line_size],
+                    &raw[(r + 1) * row_size], &raw[r * row_size], row_size,
+                    bpp);
+        });
+        memmove(&raw[0], &raw[count * row_size], row_size);
+        rows += count;
+        first += count;
+        if (pool.Size() * part_bytes <= filtered.size() - compressed &&
+            !deflate_parts(false))
+                return false;
+    }
+    return true;
+}
+
+bool PNGEncoder::Finish() {
+    if (!started || std::numeric_limits<std::uint32_t>::max() < rows)
+        return false;
+    if (!deflate_parts(true) || !write_chunk("IEND", nullptr, 0))
+        return false;
+    if (height != 0)
+        return true;
+    // Replace the height and the CRC of IHDR that follows the signature.
+    height = rows;
+    Buffer<unsigned char> header = header_data(width, height, depth,
+        color_type(components));
+    header.insert(header.begin(), "IHDR", "IHDR" + 4);
+    Buffer<unsigned char> crc;
+    crc.write_u32(static_cast<std::uint32_t>(
+        crc32(0, header.data(), static_cast<uInt>(header.size()))));
+    return out.WriteAt(20, &header[8], 4) &&
+        out.WriteAt(12 + header.size(), crc.data(), crc.size());
 }
 
 std::vector<unsigned char> memoryPNG(
     const std::vector<std::vector<std::vector<float>>>& Image, int Depth)
 {
-    std::vector<unsigned char> out;
-    std::unique_ptr<png_struct,png_destroyer> png(
-        png_create_write_struct(PNG_LIBPNG_VER_STRING,
-            nullptr, &png_error_handler, &png_warning_handler),
-        &destroy_png);
-    if (!png)
-        return out;
-    png_set_write_fn(png.get(), reinterpret_cast<void*>(&out), append, nullptr);
-    png_s = png.get();
-    std::unique_ptr<png_info,info_destroyer> info(
-        png_create_info_struct(png.get()), &destroy_info);
-    if (!info)
-        return out;
-    if (setjmp(png_jmpbuf(png.get())))
-        return out;
-    int color_type;
-    switch (Image[0][0].size()) {
-    case 1: color_type = PNG_COLOR_TYPE_GRAY; break;
-    case 2: color_type = PNG_COLOR_TYPE_GRAY_ALPHA; break;
-    case 3: color_type = PNG_COLOR_TYPE_RGB; break;
-    case 4: color_type = PNG_COLOR_TYPE_RGB_ALPHA; break;
-    }
-    png_set_IHDR(png.get(), info.get(), Image[0].size(), Image.size(), Depth,
-        color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
-        PNG_FILTER_TYPE_BASE);
-    png_write_info(png.get(), info.get());
-    std::vector<std::uint32_t> rows;
-    rows.reserve(Image.size());
-    const size_t row_size = Image[0].size() * Image[0][0].size() * (Depth / 8);
-    Buffer<char> buf;
-    buf.reserve(Image.size() * row_size);
-    for (auto& line : Image) {
-        for (auto& pixel : line)
-            if (Depth == 8)
-                for (auto& component : pixel)
-                    buf << static_cast<char>(
-                        static_cast<unsigned char>(component));
-            else
-                for (auto& component : pixel) {
-                    std::uint16_t val = static_cast<std::uint16_t>(component);
-                    buf << static_cast<char>((val >> 8) & 0xff)
-                        << static_cast<char>(val & 0xff);
+    // Integers in range map to themselves.
+    ThreadPool pool(0);
+    return memoryPNG(Image, Depth,
+        Quantizer(0.0f, float(1 << Depth), Depth), pool);
+}
+
+std::vector<unsigned char> memoryPNG(
+    const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+    const Quantizer& Q, ThreadPool& Pool, PNGProfile Profile)
+{
+    MemorySink sink;
+    PNGEncoder enc(sink, Image[0].size(), Image.size(), Image[0][0].size(),
+        Depth, Q, Pool, Profile);
+    if (!enc.Append(Image, 0, Image.size()) || !enc.Finish())
+        return std::vector<unsigned char>();
+    return std::move(sink.data);
+}
+
+#if defined(BENCHMARK)
+
+typedef std::vector<std::vector<std::vector<float>>> Image;
+
+// Synthetic corpus: flat areas, smooth gradient, photo-like and noise.
+static Image make_image(int Kind, size_t Width, size_t Height) {
+    std::mt19937 gen(Kind);
+    std::uniform_real_distribution<float> noise(0.0f, 1.0f);
+    Image img(Height, std::vector<std::vector<float>>(Width,
+        std::vector<float>(3)));
+    for (size_t y = 0; y < Height; ++y)
+        for (size_t x = 0; x < Width; ++x)
+            for (size_t c = 0; c < 3; ++c) {
+                float fx = float(x) / Width, fy = float(y) / Height;
+                float& v = img[y][x][c];
+                switch (Kind) {
+                case 0: v = ((x / 64 + y / 64 + c) % 3) / 2.0f; break;
+                case 1: v = (fx + fy + c * 0.1f) / 1.2f; break;
+                case 2:
+                    v = 0.5f + 0.25f * std::sin(fx * 17.0f + c) *
+                        std::cos(fy * 11.0f) + 0.02f * noise(gen);
+                    break;
+                default: v = noise(gen); break;
                 }
-        rows.push_back(rows.empty() ? 0 : rows.back() + row_size);
+            }
+    return img;
+}
+
+int main(int argc, char** argv) {
+    const char* kinds[] = { "flat", "gradient", "photo", "noise" };
+    const char* profiles[] = { "speed", "balanced", "size" };
+    ThreadPool pool(0);
+    for (int kind = 0; kind < 4; ++kind) {
+        Image img = make_image(kind, 2048, 1024);
+        for (int depth : { 8, 16 }) {
+            Quantizer q(0.0f, 1.0f, depth);
+            for (int p = PNGSpeed; p <= PNGSize; ++p) {
+                double best = 0.0;
+                size_t size = 0;
+                for (int k = 0; k < 3; ++k) {
+                    auto start = std::chrono::steady_clock::now();
+                    size = memoryPNG(img, depth, q, pool,
+                        static_cast<PNGProfile>(p)).size();
+                    std::chrono::duration<double> d =
+                        std::chrono::steady_clock::now() - start;
+                    if (k == 0 || d.count() < best)
+                        best = d.count();
+                }
+                std::cout << kinds[kind] << ' ' << depth << ' '
+                    << profiles[p] << ' ' << best * 1e3 << " ms "
+                    << size << " bytes\n";
+            }
+        }
     }
-    std::vector<png_bytep> row_pointers;
-    row_pointers.reserve(Image.size());
-    for (const auto idx : rows) {
-        row_pointers.push_back(reinterpret_cast<png_bytep>(&buf.front()) + idx);
+    return 0;
+}
+
+#endif
+
+#if defined(UNITTEST)
+
+// Inflates and unfilters PNG image data to packed rows.
+static std::vector<unsigned char> decode(const std::vector<unsigned char>& Png,
+    size_t RowSize, size_t Bpp)
+{
+    std::vector<unsigned char> data;
+    for (size_t p = 8; p + 12 <= Png.size();) {
+        size_t len = (size_t(Png[p]) << 24) | (size_t(Png[p + 1]) << 16) |
+            (size_t(Png[p + 2]) << 8) | Png[p + 3];
+        if (memcmp(&Png[p + 4], "IDAT", 4) == 0)
+            data.insert(data.end(), &Png[p + 8], &Png[p + 8] + len);
+        p += len + 12;
+    }
+    std::vector<unsigned char> lines(64 << 20);
+    uLongf size = lines.size();
+    REQUIRE(uncompress(lines.data(), &size, data.data(), data.size()) == Z_OK);
+    REQUIRE(size % (RowSize + 1) == 0);
+    std::vector<unsigned char> out;
+    std::vector<unsigned char> prev(RowSize, 0), row(RowSize);
+    for (size_t r = 0; r < size / (RowSize + 1); ++r) {
+        const unsigned char* line = &lines[r * (RowSize + 1)];
+        for (size_t k = 0; k < RowSize; ++k) {
+            unsigned int a = (Bpp <= k) ? row[k - Bpp] : 0;
+            unsigned int c = (Bpp <= k) ? prev[k - Bpp] : 0;
+            unsigned int pred = 0;
+            switch (line[0]) {
+            case 1: pred = a; break;
+            case 2: pred = prev[k]; break;
+            case 3: pred = (a + prev[k]) >> 1; break;
+            case 4: pred = paeth(a, prev[k], c); break;
+            }
+            row[k] = static_cast<unsigned char>(line[k + 1] + pred);
+        }
+        out.insert(out.end(), row.begin(), row.end());
+        prev = row;
     }
-    png_write_image(png.get(), &row_pointers.front());
-    png_write_end(png.get(), info.get());
     return out;
 }
 
+TEST_CASE("memoryPNG profiles decode to packed rows") {
+    ThreadPool pool(3);
+    for (size_t components = 1; components <= 4; ++components)
+        for (int depth : { 8, 16 })
+            for (int kind = 0; kind < 3; ++kind) {
+                // Flat, smooth and varying content, tall enough for parts.
+                size_t width = 123, height = 700;
+                std::vector<std::vector<std::vector<float>>> img(height,
+                    std::vector<std::vector<float>>(width,
+                        std::vector<float>(components)));
+                for (size_t y = 0; y < height; ++y)
+                    for (size_t x = 0; x < width; ++x)
+                        for (size_t c = 0; c < components; ++c)
+                            img[y][x][c] = (kind == 0) ? 0.5f :
+                                ((kind == 1) ? float(x + y) / (width + height) :
+                                float((x * 7919 + y * 104729 + c * 31) % 1000)
+                                    / 1000.0f);
+                Quantizer q(0.0f, 1.0f, depth);
+                size_t bpp = components * (depth / 8);
+                std::vector<unsigned char> expected(height * width * bpp);
+                q.pack_rows(pool,
+                    (depth == 8) ? &Quantizer::pack8 : &Quantizer::pack16be,
+                    expected.data(), width * bpp, img, 0, height);
+                for (int p = PNGSpeed; p <= PNGSize; ++p) {
+                    std::vector<unsigned char> png = memoryPNG(img, depth, q,
+                        pool, static_cast<PNGProfile>(p));
+                    REQUIRE(!png.empty());
+                    REQUIRE(decode(png, width * bpp, bpp) == expected);
+                }
+            }
+}
+
+#endif
+
 #endif
@@ -9,12 +9,66 @@
 #if !defined(MEMIMAGE_HPP)
 #define MEMIMAGE_HPP
 
+#include "quantize.hpp"
+#include "sink.hpp"
 #include <vector>
 
 
 #if !defined(NO_PNG)
+// Trade-offs between encoding time and size. Filter type and zlib strategy
+// are chosen based on a sample of rows.
+enum PNGProfile {
+    PNGSpeed, // Fast compression, one filter type for all rows.
+    PNGBalanced, // Default compression, filter type per row if it varies.
+    PNGSize // Best compression, strategy and filter tried on sample rows.
+};
+
+// Writes PNG to Out as rows are appended. Rows are packed, filtered and
+// deflated in batches so that only a batch is held in memory, with parts of
+// a batch deflated in parallel. Encoding is chosen using the first rows.
+class PNGEncoder {
+private:
+    ByteSink& out;
+    const Quantizer& q;
+    ThreadPool& pool;
+    PNGProfile profile;
+    size_t width, height, components, rows;
+    int depth, filter, level, strategy;
+    std::uint32_t checksum;
+    bool started;
+    // Last packed row, previous to the next appended row.
+    std::vector<unsigned char> raw;
+    // End of filtered data that has been compressed, followed by the rest.
+    std::vector<unsigned char> filtered;
+    size_t compressed;
+
+    bool start(const unsigned char* Sample, size_t Rows);
+    bool write_chunk(const char* Type, const unsigned char* Data,
+        size_t Length);
+    bool deflate_parts(bool Last);
+
+public:
+    // Height is written when Finish is called if it is 0 here.
+    PNGEncoder(ByteSink& Out, size_t Width, size_t Height, size_t Components,
+        int Depth, const Quantizer& Q, ThreadPool& Pool,
+        PNGProfile Profile = PNGBalanced);
+
+    // Encodes Image rows [Begin, End). Returns false on error.
+    bool Append(const std::vector<std::vector<std::vector<float>>>& Image,
+        size_t Begin, size_t End);
+    // Writes rest of the data and the end. Returns false on error.
+    bool Finish();
+};
+
+// Image values are integers in [0, 2^Depth - 1].
 std::vector<unsigned char> memoryPNG(
     const std::vector<std::vector<std::vector<float>>>& Image, int Depth);
+
+// Image values are mapped to [0, 2^Depth - 1] using Q while packing rows
+// in parallel.
+std::vector<unsigned char> memoryPNG(
+    const std::vector<std::vector<std::vector<float>>>& Image, int Depth,
+    const Quantizer& Q, ThreadPool& Pool, PNGProfile Profile = PNGBalanced);
 #endif
 
 #endif
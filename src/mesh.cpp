@@ -0,0 +1,469 @@
+//
+//  mesh.cpp
+//
+//  Created by Ismo Kärkkäinen on 18.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+#include "mesh.hpp"
+#if defined(UNITTEST)
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest/doctest.h"
+#include <cmath>
+#endif
+#if defined(BENCHMARK)
+#include <chrono>
+#include <random>
+#endif
+#include <iostream>
+#include <cstring>
+#include <strings.h>
+#include <algorithm>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+
+// Updates Minimum and Maximum with Count vertices in Src. Comparisons are
+// those of min and max instructions, so NaN is ignored.
+static void scalar_bounds(float* Minimum, float* Maximum, const float* Src,
+    size_t Count, size_t Components)
+{
+    for (size_t v = 0; v < Count; ++v, Src += Components)
+        for (size_t k = 0; k < Components; ++k) {
+            if (Src[k] < Minimum[k])
+                Minimum[k] = Src[k];
+            if (Maximum[k] < Src[k])
+                Maximum[k] = Src[k];
+        }
+}
+
+#if defined(__SSE__)
+// Takes 4 * Regs floats at a time, a whole number of vertices, so lane l of
+// register r always holds component (4 * r + l) % Components. Lanes are
+// folded into the result at the end and the remaining vertices are done one
+// at a time.
+template<size_t Regs>
+static void sse_bounds(float* Minimum, float* Maximum, const float* Src,
+    size_t Count, size_t Components)
+{
+    const size_t group = 4 * Regs / Components;
+    float lanes[2][4 * Regs];
+    for (size_t n = 0; n < 4 * Regs; ++n) {
+        lanes[0][n] = Minimum[n % Components];
+        lanes[1][n] = Maximum[n % Components];
+    }
+    __m128 mn[Regs], mx[Regs];
+    for (size_t r = 0; r < Regs; ++r) {
+        mn[r] = _mm_loadu_ps(lanes[0] + 4 * r);
+        mx[r] = _mm_loadu_ps(lanes[1] + 4 * r);
+    }
+    size_t v = 0;
+    for (; v + group <= Count; v += group, Src += 4 * Regs)
+        for (size_t r = 0; r < Regs; ++r) {
+            // Second operand is returned when either is NaN.
+            __m128 x = _mm_loadu_ps(Src + 4 * r);
+            mn[r] = _mm_min_ps(x, mn[r]);
+            mx[r] = _mm_max_ps(x, mx[r]);
+        }
+    for (size_t r = 0; r < Regs; ++r) {
+        _mm_storeu_ps(lanes[0] + 4 * r, mn[r]);
+        _mm_storeu_ps(lanes[1] + 4 * r, mx[r]);
+    }
+    for (size_t n = 0; n < 4 * Regs; ++n) {
+        const size_t k = n % Components;
+        if (lanes[0][n] < Minimum[k])
+            Minimum[k] = lanes[0][n];
+        if (Maximum[k] < lanes[1][n])
+            Maximum[k] = lanes[1][n];
+    }
+    scalar_bounds(Minimum, Maximum, Src, Count - v, Components);
+}
+#endif
+
+// Updates Minimum and Maximum, which hold values of some vertex.
+static void update_bounds(float* Minimum, float* Maximum, const float* Src,
+    size_t Count, size_t Components)
+{
+#if defined(__SSE__)
+    if (Components == 1 || Components == 2 || Components == 4) {
+        sse_bounds<4>(Minimum, Maximum, Src, Count, Components);
+        return;
+    }
+    if (Components == 3) {
+        sse_bounds<3>(Minimum, Maximum, Src, Count, Components);
+        return;
+    }
+#endif
+    scalar_bounds(Minimum, Maximum, Src, Count, Components);
+}
+
+void attribute_bounds(float* Minimum, float* Maximum, const float* Src,
+    size_t Count, size_t Components)
+{
+    if (Count == 0)
+        return;
+    memcpy(Minimum, Src, Components * sizeof(float));
+    memcpy(Maximum, Src, Components * sizeof(float));
+    update_bounds(Minimum, Maximum, Src + Components, Count - 1, Components);
+}
+
+// Copies rows of Src to Dst. Returns false if a row is not Components long.
+// Common sizes are known at compile time so that copies are inlined.
+template<size_t Components>
+static bool copy_rows(float* Dst, const std::vector<std::vector<float>>& Src,
+    size_t Begin, size_t End, size_t Count)
+{
+    const size_t n = Components ? Components : Count;
+    for (size_t r = Begin; r < End; ++r, Dst += n) {
+        if (Src[r].size() != n)
+            return false;
+        memcpy(Dst, Src[r].data(), n * sizeof(float));
+    }
+    return true;
+}
+
+bool mesh_attribute(MeshAttribute& Out,
+    const std::vector<std::vector<float>>& Src, size_t Components,
+    ThreadPool& Pool)
+{
+    Out.values.clear();
+    Out.minimum.clear();
+    Out.maximum.clear();
+    Out.components = Components;
+    if (Src.empty())
+        return false;
+    if (Components == 0)
+        Out.components = Src.front().size();
+    const size_t n = Out.components;
+    if (n == 0)
+        return false;
+    Out.values.resize(Src.size() * n);
+    std::vector<float> mins(Pool.Size() * n), maxs(Pool.Size() * n);
+    std::vector<char> bad(Pool.Size(), 0);
+    // Bounds are found for blocks of copied vertices while still in cache.
+    const size_t block = 1024;
+    size_t parts = Pool.Ranges(Src.size(), 4096,
+        [&](size_t Part, size_t Begin, size_t End) {
+            float* mn = &mins[Part * n];
+            float* mx = &maxs[Part * n];
+            float* dst = Out.values.data() + Begin * n;
+            for (size_t b = Begin; b < End; b += block) {
+                const size_t last = std::min(End, b + block);
+                bool ok;
+                if (n == 2)
+                    ok = copy_rows<2>(dst, Src, b, last, n);
+                else if (n == 3)
+                    ok = copy_rows<3>(dst, Src, b, last, n);
+                else if (n == 4)
+                    ok = copy_rows<4>(dst, Src, b, last, n);
+                else
+                    ok = copy_rows<0>(dst, Src, b, last, n);
+                if (!ok) {
+                    bad[Part] = 1;
+                    return;
+                }
+                if (b == Begin)
+                    attribute_bounds(mn, mx, dst, last - b, n);
+                else
+                    update_bounds(mn, mx, dst, last - b, n);
+                dst += (last - b) * n;
+            }
+        });
+    for (size_t p = 0; p < parts; ++p)
+        if (bad[p]) {
+            Out.values.clear();
+            return false;
+        }
+    Out.minimum.assign(mins.begin(), mins.begin() + n);
+    Out.maximum.assign(maxs.begin(), maxs.begin() + n);
+    for (size_t p = 1; p < parts; ++p)
+        for (size_t k = 0; k < n; ++k) {
+            if (mins[p * n + k] < Out.minimum[k])
+                Out.minimum[k] = mins[p * n + k];
+            if (Out.maximum[k] < maxs[p * n + k])
+                Out.maximum[k] = maxs[p * n + k];
+        }
+    return true;
+}
+
+// Calls Fill(Strip) for each strip in parallel and sets the range of indexes
+// in strips that have triangles.
+template<typename Func>
+static void fill_indices(Mesh& Out,
+    const std::vector<std::vector<std::uint32_t>>& Strips, ThreadPool& Pool,
+    Func Fill)
+{
+    Out.index_minimum = Out.index_maximum = 0;
+    if (Out.indices.empty())
+        return;
+    std::vector<std::uint32_t> mins(Pool.Size(), 0xffffffffU),
+        maxs(Pool.Size(), 0);
+    size_t parts = Pool.Ranges(Strips.size(), 256,
+        [&](size_t Part, size_t Begin, size_t End) {
+            std::uint32_t mn = mins[Part], mx = maxs[Part];
+            for (size_t s = Begin; s < End; ++s) {
+                const auto& strip = Strips[s];
+                if (strip.size() < 3)
+                    continue;
+                Fill(s);
+                for (auto index : strip) {
+                    mn = std::min(mn, index);
+                    mx = std::max(mx, index);
+                }
+            }
+            mins[Part] = mn;
+            maxs[Part] = mx;
+        });
+    Out.index_minimum = *std::min_element(mins.begin(), mins.begin() + parts);
+    Out.index_maximum = *std::max_element(maxs.begin(), maxs.begin() + parts);
+}
+
+void mesh_triangles(Mesh& Out,
+    const std::vector<std::vector<std::uint32_t>>& Strips, ThreadPool& Pool)
+{
+    // Triangles of a strip start after those of the preceding strips.
+    std::vector<size_t> strip_start(Strips.size() + 1, 0);
+    for (size_t k = 0; k < Strips.size(); ++k)
+        strip_start[k + 1] = strip_start[k] +
+            ((Strips[k].size() < 3) ? 0 : 3 * (Strips[k].size() - 2));
+    Out.indices.resize(strip_start.back());
+    Out.strip = false;
+    fill_indices(Out, Strips, Pool, [&](size_t S) {
+        std::uint32_t* dst = Out.indices.data() + strip_start[S];
+        const auto& strip = Strips[S];
+        for (size_t k = 0; k + 2 < strip.size(); ++k) {
+            dst[0] = strip[k];
+            dst[1] = strip[k + 1 + (k & 1)];
+            dst[2] = strip[k + 2 - (k & 1)];
+            dst += 3;
+        }
+    });
+}
+
+bool mesh_strip(Mesh& Out,
+    const std::vector<std::vector<std::uint32_t>>& Strips, ThreadPool& Pool)
+{
+    // A strip after the first is preceded by the last index of the previous
+    // strip and its own first index. Last index is repeated once more when
+    // needed to start the strip at an even position, to keep the winding.
+    // All triangles that span the join have a repeated index.
+    std::vector<size_t> strip_start(Strips.size(), 0), bridge(Strips.size(), 0);
+    std::vector<std::uint32_t> previous(Strips.size(), 0);
+    size_t length = 0, triangles = 0;
+    std::uint32_t last = 0;
+    for (size_t k = 0; k < Strips.size(); ++k) {
+        if (Strips[k].size() < 3)
+            continue;
+        if (length)
+            bridge[k] = (length & 1) ? 3 : 2;
+        length += bridge[k];
+        strip_start[k] = length;
+        previous[k] = last;
+        length += Strips[k].size();
+        triangles += 3 * (Strips[k].size() - 2);
+        last = Strips[k].back();
+    }
+    if (triangles <= length)
+        return false;
+    Out.indices.resize(length);
+    Out.strip = true;
+    fill_indices(Out, Strips, Pool, [&](size_t S) {
+        std::uint32_t* dst = Out.indices.data() + strip_start[S];
+        const auto& strip = Strips[S];
+        for (size_t k = 2; k <= bridge[S]; ++k)
+            dst[-static_cast<std::ptrdiff_t>(k)] = previous[S];
+        if (bridge[S])
+            dst[-1] = strip.front();
+        std::copy(strip.begin(), strip.end(), dst);
+    });
+    return true;
+}
+
+bool primitives_option(bool& Strips, const std::string& Value) {
+    if (strcasecmp(Value.c_str(), "strips") == 0)
+        Strips = true;
+    else if (strcasecmp(Value.c_str(), "triangles") == 0)
+        Strips = false;
+    else {
+        std::cerr << "Unsupported primitives: " << Value << std::endl;
+        return false;
+    }
+    return true;
+}
+
+#if defined(BENCHMARK)
+
+// Previous way of copying vertices and finding bounds, as in writegltf.
+static void baseline_flatten(std::vector<float>& Out, std::vector<float>& Min,
+    std::vector<float>& Max, const std::vector<std::vector<float>>& Src)
+{
+    const size_t n = Src.front().size();
+    Out.resize(0);
+    Out.reserve(Src.size() * n);
+    Min = Max = Src.front();
+    for (auto& vertex : Src)
+        for (size_t k = 0; k < n; ++k) {
+            Out.push_back(vertex[k]);
+            if (Max[k] < vertex[k])
+                Max[k] = vertex[k];
+            else if (vertex[k] < Min[k])
+                Min[k] = vertex[k];
+        }
+}
+
+template<typename Func>
+static double best_seconds(Func F) {
+    double best = 0.0;
+    for (int k = 0; k < 5; ++k) {
+        auto start = std::chrono::steady_clock::now();
+        F();
+        std::chrono::duration<double> d =
+            std::chrono::steady_clock::now() - start;
+        if (k == 0 || d.count() < best)
+            best = d.count();
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    const size_t count = size_t(1) << 22;
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<float> dist(-100.0f, 100.0f);
+    ThreadPool pool(0);
+    auto report = [&](const char* Name, size_t Components, double Seconds) {
+        std::cout << Name << ' ' << Components << ' '
+            << (count / Seconds) * 1e-6 << " Mvertices/s\n";
+    };
+    for (size_t n = 2; n <= 3; ++n) {
+        std::vector<std::vector<float>> src(count, std::vector<float>(n));
+        for (auto& vertex : src)
+            for (auto& v : vertex)
+                v = dist(gen);
+        std::vector<float> flat, mn, mx;
+        report("baseline", n, best_seconds(
+            [&]() { baseline_flatten(flat, mn, mx, src); }));
+        MeshAttribute attr;
+        report("mesh_attribute", n, best_seconds(
+            [&]() { mesh_attribute(attr, src, n, pool); }));
+        report("scalar", n, best_seconds([&]() {
+            mn = mx = src.front();
+            scalar_bounds(mn.data(), mx.data(), attr.values.data(), count, n);
+        }));
+        report("attribute_bounds", n, best_seconds([&]() {
+            attribute_bounds(mn.data(), mx.data(), attr.values.data(),
+                count, n);
+        }));
+    }
+    return 0;
+}
+
+#endif
+
+#if defined(UNITTEST)
+
+TEST_CASE("attribute_bounds matches scalar") {
+    for (size_t n = 1; n <= 6; ++n)
+        for (size_t count = 1; count < 40; ++count) {
+            std::vector<float> src(n * count);
+            for (size_t k = 0; k < src.size(); ++k)
+                src[k] = float((k * 7919) % 101) - 50.0f;
+            if (1 < count)
+                src[n * (count / 2)] = NAN;
+            std::vector<float> mn(n), mx(n), emn(src.begin(), src.begin() + n);
+            std::vector<float> emx(emn);
+            scalar_bounds(emn.data(), emx.data(), src.data() + n, count - 1, n);
+            attribute_bounds(mn.data(), mx.data(), src.data(), count, n);
+            INFO("components " << n << " count " << count);
+            REQUIRE(mn == emn);
+            REQUIRE(mx == emx);
+        }
+}
+
+TEST_CASE("mesh_attribute copies vertices and finds bounds") {
+    ThreadPool pool(3);
+    std::vector<std::vector<float>> src;
+    for (int k = 0; k < 20000; ++k)
+        src.push_back(std::vector<float> {
+            float(k), float(-k), float(k % 77) });
+    MeshAttribute attr;
+    REQUIRE(mesh_attribute(attr, src, 3, pool));
+    REQUIRE(attr.Count() == src.size());
+    for (size_t k = 0; k < src.size(); ++k)
+        for (size_t c = 0; c < 3; ++c)
+            REQUIRE(attr.values[3 * k + c] == src[k][c]);
+    REQUIRE(attr.minimum == std::vector<float> { 0.0f, -19999.0f, 0.0f });
+    REQUIRE(attr.maximum == std::vector<float> { 19999.0f, 0.0f, 76.0f });
+    SUBCASE("Size from first vertex") {
+        REQUIRE(mesh_attribute(attr, src, 0, pool));
+        REQUIRE(attr.components == 3);
+    }
+    SUBCASE("Wrong size") {
+        src[15000].push_back(1.0f);
+        REQUIRE_FALSE(mesh_attribute(attr, src, 3, pool));
+        src[15000].resize(3);
+        REQUIRE_FALSE(mesh_attribute(attr, src, 2, pool));
+    }
+    SUBCASE("Empty") {
+        REQUIRE_FALSE(mesh_attribute(attr,
+            std::vector<std::vector<float>>(), 3, pool));
+    }
+}
+
+TEST_CASE("mesh_triangles keeps winding of strips") {
+    ThreadPool pool(2);
+    std::vector<std::vector<std::uint32_t>> strips {
+        { 4, 5, 6, 7, 8 }, { 1, 2 }, { }, { 9, 3, 10 } };
+    Mesh mesh;
+    mesh_triangles(mesh, strips, pool);
+    REQUIRE(mesh.indices == std::vector<std::uint32_t> {
+        4, 5, 6, 5, 7, 6, 6, 7, 8, 9, 3, 10 });
+    REQUIRE(mesh.index_minimum == 3);
+    REQUIRE(mesh.index_maximum == 10);
+    mesh_triangles(mesh, std::vector<std::vector<std::uint32_t>>(), pool);
+    REQUIRE(mesh.indices.empty());
+}
+
+TEST_CASE("mesh_strip joins strips keeping triangles and winding") {
+    ThreadPool pool(2);
+    std::vector<std::vector<std::uint32_t>> strips;
+    for (std::uint32_t k = 0; k < 500; ++k) {
+        std::vector<std::uint32_t> strip;
+        // Odd and even lengths make joins at both parities.
+        for (std::uint32_t n = 0; n < 5 + k % 4; ++n)
+            strip.push_back(k * 10 + n);
+        strips.push_back(strip);
+        if (k % 7 == 0)
+            strips.push_back(std::vector<std::uint32_t> { k });
+    }
+    Mesh joined, listed;
+    REQUIRE(mesh_strip(joined, strips, pool));
+    REQUIRE(joined.strip);
+    mesh_triangles(listed, strips, pool);
+    REQUIRE_FALSE(listed.strip);
+    REQUIRE(joined.indices.size() < listed.indices.size());
+    REQUIRE(joined.index_minimum == listed.index_minimum);
+    REQUIRE(joined.index_maximum == listed.index_maximum);
+    // Strip expanded without degenerate triangles equals the list.
+    std::vector<std::uint32_t> expanded;
+    const auto& s = joined.indices;
+    for (size_t k = 0; k + 2 < s.size(); ++k) {
+        std::uint32_t a = s[k], b = s[k + 1 + (k & 1)], c = s[k + 2 - (k & 1)];
+        if (a == b || b == c || a == c)
+            continue;
+        expanded.insert(expanded.end(), { a, b, c });
+    }
+    REQUIRE(expanded == listed.indices);
+    SUBCASE("Short strips stay as triangles") {
+        std::vector<std::vector<std::uint32_t>> short_strips(100,
+            std::vector<std::uint32_t> { 1, 2, 3 });
+        REQUIRE_FALSE(mesh_strip(joined, short_strips, pool));
+        REQUIRE(joined.strip);
+        REQUIRE(mesh_strip(joined,
+            std::vector<std::vector<std::uint32_t>>(1, strips[0]), pool));
+        REQUIRE(joined.indices == strips[0]);
+    }
+}
+
+#endif
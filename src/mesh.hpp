@@ -0,0 +1,92 @@
+//
+//  mesh.hpp
+//
+//  Created by Ismo Kärkkäinen on 18.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+// Model data converted once from parsed input into flat arrays that the
+// glTF, GLB and COLLADA writers output as they are.
+
+#if !defined(MESH_HPP)
+#define MESH_HPP
+
+#include "parallel.hpp"
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+
+// Vertex attribute with components of each vertex next to each other.
+struct MeshAttribute {
+    size_t components;
+    std::vector<float> values;
+    // Component-wise, as needed for accessor min and max.
+    std::vector<float> minimum, maximum;
+
+    MeshAttribute() : components(0) { }
+
+    size_t Count() const {
+        return components ? values.size() / components : 0;
+    }
+    size_t Bytes() const { return values.size() * sizeof(float); }
+};
+
+struct Mesh {
+    // Three vertex indexes per triangle, or one triangle strip if strip is
+    // set. Triangles are wound as in the input strips.
+    std::vector<std::uint32_t> indices;
+    std::uint32_t index_minimum, index_maximum;
+    bool strip;
+    MeshAttribute positions, colors, coordinates;
+
+    Mesh() : index_minimum(0), index_maximum(0), strip(false) { }
+
+    size_t IndexBytes() const {
+        return indices.size() * sizeof(std::uint32_t);
+    }
+};
+
+// Component-wise minimum and maximum of Count vertices in Src. NaN is
+// ignored unless it is in the first vertex.
+void attribute_bounds(float* Minimum, float* Maximum, const float* Src,
+    size_t Count, size_t Components);
+
+// Copies Src to Out and finds its bounds. Components 0 takes the size of
+// the first vertex. Returns false if Src is empty or a vertex has a
+// different size.
+bool mesh_attribute(MeshAttribute& Out,
+    const std::vector<std::vector<float>>& Src, size_t Components,
+    ThreadPool& Pool);
+
+// Converts tri-strips to triangles, in strip order. Strips shorter than 3
+// have no triangles.
+void mesh_triangles(Mesh& Out,
+    const std::vector<std::vector<std::uint32_t>>& Strips, ThreadPool& Pool);
+
+// Joins tri-strips into one strip with degenerate triangles in between, if
+// that takes fewer indices than triangles would. Returns false and leaves Out
+// as it was otherwise. Strips shorter than 3 are left out.
+bool mesh_strip(Mesh& Out,
+    const std::vector<std::vector<std::uint32_t>>& Strips, ThreadPool& Pool);
+
+// Sets Strips if Value is strips, clears it if triangles. Returns false and
+// prints an error for other values.
+bool primitives_option(bool& Strips, const std::string& Value);
+
+// Converts Count 32-bit values in Data to little-endian byte order in place,
+// as glTF buffers require, so that arrays can be output as they are.
+inline void little_endian32(void* Data, size_t Count) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    unsigned char* d = static_cast<unsigned char*>(Data);
+    for (size_t k = 0; k < Count; ++k, d += 4) {
+        std::swap(d[0], d[3]);
+        std::swap(d[1], d[2]);
+    }
+#endif
+}
+
+#endif
@@ -0,0 +1,170 @@
+//
+//  parallel.hpp
+//
+//  Created by Ismo Kärkkäinen on 18.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+// Helpers to split work into contiguous ranges that run in separate threads.
+
+#if !defined(PARALLEL_HPP)
+#define PARALLEL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <cstddef>
+
+
+// Number of parts to split Count items into when each part should have at
+// least MinPerPart items.
+inline size_t part_count(size_t Count, size_t MinPerPart) {
+    size_t parts = std::thread::hardware_concurrency();
+    if (parts == 0)
+        parts = 1;
+    if (MinPerPart == 0)
+        MinPerPart = 1;
+    if (Count / MinPerPart < parts)
+        parts = Count / MinPerPart;
+    return (parts == 0) ? 1 : parts;
+}
+
+// Calls Func(Part, Begin, End) for Parts contiguous ranges covering
+// [0, Count). The first part runs in the calling thread. The first exception
+// thrown by any part is re-thrown after all parts have finished.
+template<typename Func>
+void parallel_ranges(size_t Count, size_t Parts, Func F) {
+    if (Parts < 2 || Count < 2) {
+        F(size_t(0), size_t(0), Count);
+        return;
+    }
+    if (Count < Parts)
+        Parts = Count;
+    std::vector<std::exception_ptr> errors(Parts);
+    auto run = [&](size_t Part) {
+        try {
+            F(Part, (Count * Part) / Parts, (Count * (Part + 1)) / Parts);
+        }
+        catch (...) {
+            errors[Part] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(Parts - 1);
+    for (size_t k = 1; k < Parts; ++k)
+        threads.emplace_back(run, k);
+    run(0);
+    for (auto& t : threads)
+        t.join();
+    for (auto& e : errors)
+        if (e)
+            std::rethrow_exception(e);
+}
+
+// Fixed set of worker threads that run parts of a range. The thread calling
+// Ranges runs the first part, so Threads includes it.
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, finished;
+    std::function<void(size_t)> job;
+    size_t generation, pending;
+    bool stopping;
+
+    void work(size_t Index) {
+        size_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock,
+                    [&]() { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+            }
+            job(Index);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+                finished.notify_one();
+        }
+    }
+
+    // Calls Job(Index) for each Index in [0, Size()).
+    void run(const std::function<void(size_t)>& Job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = Job;
+            pending = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+        Job(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&]() { return pending == 0; });
+    }
+
+public:
+    // Uses as many threads as there are processors if Threads is 0.
+    ThreadPool(size_t Threads)
+        : generation(0), pending(0), stopping(false)
+    {
+        if (Threads == 0)
+            Threads = part_count(~size_t(0), 1);
+        for (size_t k = 1; k < Threads; ++k)
+            workers.emplace_back(&ThreadPool::work, this, k);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers)
+            t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t Size() const { return workers.size() + 1; }
+
+    // Calls Func(Part, Begin, End) for contiguous ranges covering [0, Count)
+    // so that each has at least MinPerPart items, if possible. Returns the
+    // number of parts. The first exception thrown by any part is re-thrown
+    // after all parts have finished.
+    template<typename Func>
+    size_t Ranges(size_t Count, size_t MinPerPart, Func F) {
+        if (MinPerPart == 0)
+            MinPerPart = 1;
+        size_t parts = Size();
+        if (Count / MinPerPart < parts)
+            parts = Count / MinPerPart;
+        if (parts < 2) {
+            F(size_t(0), size_t(0), Count);
+            return 1;
+        }
+        std::vector<std::exception_ptr> errors(parts);
+        run([&](size_t Part) {
+            if (parts <= Part)
+                return;
+            try {
+                F(Part, (Count * Part) / parts, (Count * (Part + 1)) / parts);
+            }
+            catch (...) {
+                errors[Part] = std::current_exception();
+            }
+        });
+        for (auto& e : errors)
+            if (e)
+                std::rethrow_exception(e);
+        return parts;
+    }
+};
+
+#endif
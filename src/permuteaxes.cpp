@@ -0,0 +1,314 @@
+//
+//  permuteaxes.cpp
+//
+//  Created by Ismo Kärkkäinen on 18.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+#include "permuteaxes_io.hpp"
+#if defined(UNITTEST)
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest/doctest.h"
+#else
+#include "convenience.hpp"
+#include "streaming.hpp"
+#include "jsonwriter.hpp"
+#endif
+#include "parallel.hpp"
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+
+// Rows x columns x channels floats in one block, channels of a pixel next
+// to each other.
+struct Dense {
+    size_t dims[3];
+    std::vector<float> data;
+
+    Dense() : dims { 0, 0, 0 } { }
+};
+
+// Output axis k is input axis Axes[k], channels are picked by Channels.
+struct Permutation {
+    size_t axes[3];
+    std::vector<size_t> channels;
+    bool all_channels;
+};
+
+// Appends Rows to Out, picking channels. Returns false if a channel index is
+// not in the pixels or the pixels have varying channel counts.
+static bool gather(Dense& Out, const io::PermuteAxesIn::arrayType& Rows,
+    Permutation& P, ThreadPool& Pool)
+{
+    if (Rows.empty())
+        return true;
+    const size_t width = Rows[0].size();
+    const size_t components = width ? Rows[0][0].size() : 0;
+    if (Out.dims[0] == 0) {
+        Out.dims[1] = width;
+        if (P.all_channels) {
+            P.channels.resize(components);
+            for (size_t k = 0; k < components; ++k)
+                P.channels[k] = k;
+        }
+        for (auto c : P.channels)
+            if (components <= c && width) {
+                std::cerr << "Channel index " << c << " not less than "
+                    << components << std::endl;
+                return false;
+            }
+        Out.dims[2] = P.channels.size();
+    }
+    for (auto& row : Rows)
+        if (row.size() != Out.dims[1] ||
+            (width && row[0].size() != components))
+        {
+            std::cerr << "Rows or pixels differ in size." << std::endl;
+            return false;
+        }
+    const size_t row_size = Out.dims[1] * Out.dims[2];
+    const size_t first = Out.data.size();
+    Out.data.resize(first + Rows.size() * row_size);
+    Out.dims[0] += Rows.size();
+    const std::vector<size_t>& channels(P.channels);
+    Pool.Ranges(Rows.size(), 16, [&](size_t Part, size_t Begin, size_t End) {
+        float* dst = Out.data.data() + first + Begin * row_size;
+        for (size_t r = Begin; r < End; ++r)
+            for (auto& pixel : Rows[r])
+                for (auto c : channels)
+                    *dst++ = pixel[c];
+    });
+    return true;
+}
+
+// Fills Out so that its axis k is axis Axes[k] of Src. Output is filled in
+// blocks of each axis so that source reads spread over rows and the output
+// rows being written both stay in cache.
+static void permute(std::vector<std::vector<std::vector<float>>>& Out,
+    const Dense& Src, const size_t Axes[3], ThreadPool& Pool)
+{
+    const size_t block = 32;
+    const size_t strides[3] = { Src.dims[1] * Src.dims[2], Src.dims[2], 1 };
+    size_t n[3], t[3];
+    for (size_t k = 0; k < 3; ++k) {
+        n[k] = Src.dims[Axes[k]];
+        t[k] = strides[Axes[k]];
+    }
+    Out.resize(n[0]);
+    const float* src = Src.data.data();
+    Pool.Ranges((n[0] + block - 1) / block, 1,
+        [&](size_t Part, size_t Begin, size_t End) {
+            const size_t last0 = std::min(n[0], End * block);
+            for (size_t i0 = Begin * block; i0 < last0; ++i0) {
+                Out[i0].resize(n[1]);
+                for (auto& inner : Out[i0])
+                    inner.resize(n[2]);
+            }
+            // Innermost output axis is contiguous in input when it is the
+            // channel axis, so whole inner arrays are copied.
+            const size_t block2 =
+                (t[2] == 1) ? std::max(n[2], size_t(1)) : block;
+            for (size_t b0 = Begin * block; b0 < last0; b0 += block)
+                for (size_t b1 = 0; b1 < n[1]; b1 += block)
+                    for (size_t b2 = 0; b2 < n[2]; b2 += block2) {
+                        const size_t e0 = std::min(last0, b0 + block);
+                        const size_t e1 = std::min(n[1], b1 + block);
+                        const size_t e2 = std::min(n[2], b2 + block2);
+                        for (size_t i0 = b0; i0 < e0; ++i0)
+                            for (size_t i1 = b1; i1 < e1; ++i1) {
+                                float* dst = Out[i0][i1].data();
+                                const float* s = src + i0 * t[0] + i1 * t[1];
+                                if (t[2] == 1)
+                                    memcpy(dst + b2, s + b2,
+                                        (e2 - b2) * sizeof(float));
+                                else
+                                    for (size_t i2 = b2; i2 < e2; ++i2)
+                                        dst[i2] = s[i2 * t[2]];
+                            }
+                    }
+        });
+}
+
+#if !defined(UNITTEST)
+
+// Returns an error message, or empty string if options are valid.
+static std::string permutation(const io::PermuteAxesIn& Val, Permutation& P)
+{
+    for (size_t k = 0; k < 3; ++k)
+        P.axes[k] = k;
+    if (Val.axesGiven()) {
+        if (Val.axes().size() != 3)
+            return "Axes must have 3 values.";
+        bool seen[3] = { false, false, false };
+        for (size_t k = 0; k < 3; ++k) {
+            if (2 < Val.axes()[k] || seen[Val.axes()[k]])
+                return "Axes must be a permutation of 0, 1, and 2.";
+            seen[Val.axes()[k]] = true;
+            P.axes[k] = Val.axes()[k];
+        }
+    }
+    P.all_channels = !Val.channelsGiven();
+    P.channels.assign(Val.channels().begin(), Val.channels().end());
+    return std::string();
+}
+
+static int write_result(const Dense& Src, const Permutation& P,
+    ThreadPool& Pool)
+{
+    std::vector<std::vector<std::vector<std::vector<float>>>> result(1);
+    permute(result[0], Src, P.axes, Pool);
+    std::vector<std::string> names(1, "array");
+    if (!write_arrays(1, names, result, Pool, [](std::ostream& S,
+        const std::vector<std::vector<float>>& Row, std::vector<char>& B)
+        { io::Write(S, Row, B); }))
+    {
+        std::cerr << "Error writing output." << std::endl;
+        return 2;
+    }
+    return 0;
+}
+
+// Rows are gathered as they are parsed when axes are given before array.
+class AxisPermuter : public StreamingInputParser<io::ParserPool,
+    io::PermuteAxesIn_Parser, io::PermuteAxesIn>::Handler
+{
+private:
+    Permutation perm;
+    Dense dense;
+    ThreadPool pool;
+
+    void reset() {
+        dense = Dense();
+    }
+
+public:
+    AxisPermuter() : pool(0) { }
+
+    bool Begin(io::PermuteAxesIn& Val) {
+        // Errors are reported when the whole object is parsed.
+        if (!Val.axesGiven() || !permutation(Val, perm).empty())
+            return false;
+        reset();
+        return true;
+    }
+
+    int Append(io::PermuteAxesIn::arrayType& Batch) {
+        return gather(dense, Batch, perm, pool) ? 0 : 1;
+    }
+
+    int End() {
+        int status = write_result(dense, perm, pool);
+        reset();
+        return status;
+    }
+
+    int Whole(io::PermuteAxesIn& Val) {
+        std::string error = permutation(Val, perm);
+        if (!error.empty()) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        reset();
+        if (!gather(dense, Val.array(), perm, pool))
+            return 1;
+        int status = write_result(dense, perm, pool);
+        reset();
+        return status;
+    }
+};
+
+int main(int argc, char** argv) {
+    int f = 0;
+    if (argc > 1)
+        f = open(argv[1], O_RDONLY);
+    StreamingInputParser<io::ParserPool, io::PermuteAxesIn_Parser,
+        io::PermuteAxesIn> ip(f, "array");
+    AxisPermuter permuter;
+    int status = ip.ReadAndParse(permuter);
+    if (f)
+        close(f);
+    return status;
+}
+
+#else
+
+static float value(size_t Row, size_t Column, size_t Channel) {
+    return float(Row * 10000 + Column * 10 + Channel);
+}
+
+TEST_CASE("permute matches direct indexing") {
+    ThreadPool pool(3);
+    // Sizes cross block boundaries.
+    const size_t sizes[][3] = { { 1, 1, 1 }, { 3, 5, 2 }, { 33, 70, 3 },
+        { 65, 31, 4 }, { 2, 40, 35 } };
+    const size_t perms[][3] = { { 0, 1, 2 }, { 0, 2, 1 }, { 1, 0, 2 },
+        { 1, 2, 0 }, { 2, 0, 1 }, { 2, 1, 0 } };
+    for (auto& size : sizes) {
+        io::PermuteAxesIn::arrayType rows(size[0],
+            std::vector<std::vector<float>>(size[1],
+                std::vector<float>(size[2])));
+        for (size_t r = 0; r < size[0]; ++r)
+            for (size_t c = 0; c < size[1]; ++c)
+                for (size_t k = 0; k < size[2]; ++k)
+                    rows[r][c][k] = value(r, c, k);
+        Permutation p;
+        p.all_channels = true;
+        Dense dense;
+        REQUIRE(gather(dense, rows, p, pool));
+        for (auto& axes : perms) {
+            std::vector<std::vector<std::vector<float>>> out;
+            permute(out, dense, axes, pool);
+            REQUIRE(out.size() == size[axes[0]]);
+            size_t idx[3];
+            for (idx[0] = 0; idx[0] < out.size(); ++idx[0]) {
+                REQUIRE(out[idx[0]].size() == size[axes[1]]);
+                for (idx[1] = 0; idx[1] < out[idx[0]].size(); ++idx[1]) {
+                    REQUIRE(out[idx[0]][idx[1]].size() == size[axes[2]]);
+                    for (idx[2] = 0; idx[2] < size[axes[2]]; ++idx[2]) {
+                        size_t in[3];
+                        for (size_t k = 0; k < 3; ++k)
+                            in[axes[k]] = idx[k];
+                        REQUIRE(out[idx[0]][idx[1]][idx[2]] ==
+                            value(in[0], in[1], in[2]));
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("gather picks channels in given order") {
+    ThreadPool pool(2);
+    io::PermuteAxesIn::arrayType rows(2, std::vector<std::vector<float>>(3,
+        std::vector<float> { 0.0f, 1.0f, 2.0f, 3.0f }));
+    Permutation p;
+    p.all_channels = false;
+    p.channels = std::vector<size_t> { 3, 0, 0 };
+    Dense dense;
+    REQUIRE(gather(dense, rows, p, pool));
+    REQUIRE(dense.dims[0] == 2);
+    REQUIRE(dense.dims[1] == 3);
+    REQUIRE(dense.dims[2] == 3);
+    for (size_t k = 0; k < dense.data.size(); k += 3) {
+        REQUIRE(dense.data[k] == 3.0f);
+        REQUIRE(dense.data[k + 1] == 0.0f);
+        REQUIRE(dense.data[k + 2] == 0.0f);
+    }
+    SUBCASE("Index out of range") {
+        Permutation q;
+        q.all_channels = false;
+        q.channels = std::vector<size_t> { 4 };
+        Dense other;
+        REQUIRE_FALSE(gather(other, rows, q, pool));
+    }
+}
+
+#endif
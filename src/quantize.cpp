@@ -0,0 +1,773 @@
+//
+//  quantize.cpp
+//
+//  Created by Ismo Kärkkäinen on 18.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+#include "quantize.hpp"
+#if defined(UNITTEST)
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest/doctest.h"
+#endif
+#if defined(BENCHMARK)
+#include <iostream>
+#include <chrono>
+#include <random>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define QUANTIZE_X86
+#include <immintrin.h>
+#endif
+
+
+typedef void (*QuantizeFunc)(unsigned char* Dst, const float* Src,
+    size_t Count, float Minimum, float Range, float Max);
+
+// Identity versions expect Minimum 0 and Range Max - 1 and map integer values
+// in range to themselves, where the general kernels may be one too large for
+// depths above 12 due to rounding. Blocks of such values are converted
+// without arithmetic and other blocks go to the general kernel.
+struct Kernels {
+    const char* name;
+    QuantizeFunc q8, q16be, q16le;
+    QuantizeFunc i8, i16be, i16le;
+};
+
+static void scalar8(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    for (size_t k = 0; k < Count; ++k)
+        Dst[k] = static_cast<unsigned char>(
+            quantize_value(Src[k], Minimum, Range, Max));
+}
+
+static void scalar16be(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    for (size_t k = 0; k < Count; ++k) {
+        std::uint16_t val = static_cast<std::uint16_t>(
+            quantize_value(Src[k], Minimum, Range, Max));
+        *Dst++ = static_cast<unsigned char>((val >> 8) & 0xff);
+        *Dst++ = static_cast<unsigned char>(val & 0xff);
+    }
+}
+
+static void scalar16le(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    for (size_t k = 0; k < Count; ++k) {
+        std::uint16_t val = static_cast<std::uint16_t>(
+            quantize_value(Src[k], Minimum, Range, Max));
+        *Dst++ = static_cast<unsigned char>(val & 0xff);
+        *Dst++ = static_cast<unsigned char>((val >> 8) & 0xff);
+    }
+}
+
+static inline bool exact(float Value, float Top) {
+    return 0.0f <= Value && Value <= Top && Value == std::trunc(Value);
+}
+
+static void scalar_identity8(unsigned char* Dst, const float* Src,
+    size_t Count, float Minimum, float Range, float Max)
+{
+    for (size_t k = 0; k < Count; ++k)
+        if (exact(Src[k], Range))
+            Dst[k] = static_cast<unsigned char>(Src[k]);
+        else
+            scalar8(Dst + k, Src + k, 1, Minimum, Range, Max);
+}
+
+static void scalar_identity16be(unsigned char* Dst, const float* Src,
+    size_t Count, float Minimum, float Range, float Max)
+{
+    for (size_t k = 0; k < Count; ++k) {
+        if (!exact(Src[k], Range)) {
+            scalar16be(Dst + 2 * k, Src + k, 1, Minimum, Range, Max);
+            continue;
+        }
+        std::uint16_t val = static_cast<std::uint16_t>(Src[k]);
+        Dst[2 * k] = static_cast<unsigned char>((val >> 8) & 0xff);
+        Dst[2 * k + 1] = static_cast<unsigned char>(val & 0xff);
+    }
+}
+
+static void scalar_identity16le(unsigned char* Dst, const float* Src,
+    size_t Count, float Minimum, float Range, float Max)
+{
+    for (size_t k = 0; k < Count; ++k) {
+        if (!exact(Src[k], Range)) {
+            scalar16le(Dst + 2 * k, Src + k, 1, Minimum, Range, Max);
+            continue;
+        }
+        std::uint16_t val = static_cast<std::uint16_t>(Src[k]);
+        Dst[2 * k] = static_cast<unsigned char>(val & 0xff);
+        Dst[2 * k + 1] = static_cast<unsigned char>((val >> 8) & 0xff);
+    }
+}
+
+static const Kernels scalar = { "scalar", &scalar8, &scalar16be, &scalar16le,
+    &scalar_identity8, &scalar_identity16be, &scalar_identity16le };
+
+#if defined(QUANTIZE_X86)
+
+// All vector versions compute (Src - Minimum) / Range, clamp it to [0, 1]
+// with max and min that return 0 for NaN, multiply by Max, limit to Max - 1
+// and truncate. For Range 0 the division gives infinity or NaN, which ends up
+// 1 or 0 as in quantize_value. Limiting before truncation equals the check
+// for Max after it since the product never exceeds Max.
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_quantize(const float* Src,
+    __m128 Minimum, __m128 Range, __m128 Max, __m128 Top)
+{
+    __m128 v = _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(Src), Minimum), Range);
+    v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    return _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(v, Max), Top));
+}
+
+// Packs 8 values in [0, 65535] to unsigned 16-bit little-endian.
+__attribute__((target("sse2")))
+static inline __m128i sse2_pack16(__m128i A, __m128i B) {
+    const __m128i bias32 = _mm_set1_epi32(32768);
+    const __m128i bias16 = _mm_set1_epi16(-32768);
+    return _mm_xor_si128(bias16, _mm_packs_epi32(
+        _mm_sub_epi32(A, bias32), _mm_sub_epi32(B, bias32)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_swap16(__m128i V) {
+    return _mm_or_si128(_mm_slli_epi16(V, 8), _mm_srli_epi16(V, 8));
+}
+
+__attribute__((target("sse2")))
+static void sse2_8(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const __m128 mn = _mm_set1_ps(Minimum), r = _mm_set1_ps(Range),
+        mx = _mm_set1_ps(Max), top = _mm_set1_ps(Max - 1);
+    size_t k = 0;
+    for (; k + 16 <= Count; k += 16) {
+        __m128i a = sse2_quantize(Src + k, mn, r, mx, top);
+        __m128i b = sse2_quantize(Src + k + 4, mn, r, mx, top);
+        __m128i c = sse2_quantize(Src + k + 8, mn, r, mx, top);
+        __m128i d = sse2_quantize(Src + k + 12, mn, r, mx, top);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + k),
+            _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+    }
+    scalar8(Dst + k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+__attribute__((target("sse2")))
+static void sse2_16be(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const __m128 mn = _mm_set1_ps(Minimum), r = _mm_set1_ps(Range),
+        mx = _mm_set1_ps(Max), top = _mm_set1_ps(Max - 1);
+    size_t k = 0;
+    for (; k + 8 <= Count; k += 8) {
+        __m128i a = sse2_quantize(Src + k, mn, r, mx, top);
+        __m128i b = sse2_quantize(Src + k + 4, mn, r, mx, top);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + 2 * k),
+            sse2_swap16(sse2_pack16(a, b)));
+    }
+    scalar16be(Dst + 2 * k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+__attribute__((target("sse2")))
+static void sse2_16le(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const __m128 mn = _mm_set1_ps(Minimum), r = _mm_set1_ps(Range),
+        mx = _mm_set1_ps(Max), top = _mm_set1_ps(Max - 1);
+    size_t k = 0;
+    for (; k + 8 <= Count; k += 8) {
+        __m128i a = sse2_quantize(Src + k, mn, r, mx, top);
+        __m128i b = sse2_quantize(Src + k + 4, mn, r, mx, top);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + 2 * k),
+            sse2_pack16(a, b));
+    }
+    scalar16le(Dst + 2 * k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+// Converts 4 values and returns a bit for each that is an integer in
+// [0, Top], and so converted exactly. Out of range values convert to
+// 0x80000000 which does not convert back to the same value.
+__attribute__((target("sse2")))
+static inline int sse2_exact(const float* Src, __m128 Top, __m128i& Out) {
+    __m128 v = _mm_loadu_ps(Src);
+    Out = _mm_cvttps_epi32(v);
+    __m128 ok = _mm_and_ps(_mm_cmpeq_ps(_mm_cvtepi32_ps(Out), v),
+        _mm_and_ps(_mm_cmpge_ps(v, _mm_setzero_ps()), _mm_cmple_ps(v, Top)));
+    return _mm_movemask_ps(ok);
+}
+
+__attribute__((target("sse2")))
+static void sse2_identity8(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const __m128 top = _mm_set1_ps(Range);
+    size_t k = 0;
+    for (; k + 16 <= Count; k += 16) {
+        __m128i a, b, c, d;
+        if ((sse2_exact(Src + k, top, a) & sse2_exact(Src + k + 4, top, b) &
+            sse2_exact(Src + k + 8, top, c) &
+            sse2_exact(Src + k + 12, top, d)) != 0xf)
+        {
+            sse2_8(Dst + k, Src + k, 16, Minimum, Range, Max);
+            continue;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + k),
+            _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+    }
+    scalar_identity8(Dst + k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+__attribute__((target("sse2")))
+static void sse2_identity16be(unsigned char* Dst, const float* Src,
+    size_t Count, float Minimum, float Range, float Max)
+{
+    const __m128 top = _mm_set1_ps(Range);
+    size_t k = 0;
+    for (; k + 8 <= Count; k += 8) {
+        __m128i a, b;
+        if ((sse2_exact(Src + k, top, a) & sse2_exact(Src + k + 4, top, b))
+            != 0xf)
+        {
+            sse2_16be(Dst + 2 * k, Src + k, 8, Minimum, Range, Max);
+            continue;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + 2 * k),
+            sse2_swap16(sse2_pack16(a, b)));
+    }
+    scalar_identity16be(Dst + 2 * k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+__attribute__((target("sse2")))
+static void sse2_identity16le(unsigned char* Dst, const float* Src,
+    size_t Count, float Minimum, float Range, float Max)
+{
+    const __m128 top = _mm_set1_ps(Range);
+    size_t k = 0;
+    for (; k + 8 <= Count; k += 8) {
+        __m128i a, b;
+        if ((sse2_exact(Src + k, top, a) & sse2_exact(Src + k + 4, top, b))
+            != 0xf)
+        {
+            sse2_16le(Dst + 2 * k, Src + k, 8, Minimum, Range, Max);
+            continue;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + 2 * k),
+            sse2_pack16(a, b));
+    }
+    scalar_identity16le(Dst + 2 * k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+static const Kernels sse2 = { "sse2", &sse2_8, &sse2_16be, &sse2_16le,
+    &sse2_identity8, &sse2_identity16be, &sse2_identity16le };
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_quantize(const float* Src,
+    __m256 Minimum, __m256 Range, __m256 Max, __m256 Top)
+{
+    __m256 v = _mm256_div_ps(
+        _mm256_sub_ps(_mm256_loadu_ps(Src), Minimum), Range);
+    v = _mm256_min_ps(
+        _mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+    return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(v, Max), Top));
+}
+
+// Packs 16 values in [0, 65535] to unsigned 16-bit in order.
+__attribute__((target("avx2")))
+static inline __m256i avx2_pack16(__m256i A, __m256i B) {
+    return _mm256_permute4x64_epi64(_mm256_packus_epi32(A, B), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_swap16(__m256i V) {
+    return _mm256_or_si256(_mm256_slli_epi16(V, 8), _mm256_srli_epi16(V, 8));
+}
+
+__attribute__((target("avx2")))
+static void avx2_8(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const __m256 mn = _mm256_set1_ps(Minimum), r = _mm256_set1_ps(Range),
+        mx = _mm256_set1_ps(Max), top = _mm256_set1_ps(Max - 1);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t k = 0;
+    for (; k + 32 <= Count; k += 32) {
+        __m256i a = avx2_quantize(Src + k, mn, r, mx, top);
+        __m256i b = avx2_quantize(Src + k + 8, mn, r, mx, top);
+        __m256i c = avx2_quantize(Src + k + 16, mn, r, mx, top);
+        __m256i d = avx2_quantize(Src + k + 24, mn, r, mx, top);
+        // Packing works within 128-bit lanes, hence the final permute.
+        __m256i v = _mm256_packus_epi16(
+            _mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + k),
+            _mm256_permutevar8x32_epi32(v, order));
+    }
+    sse2_8(Dst + k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+__attribute__((target("avx2")))
+static void avx2_16be(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const __m256 mn = _mm256_set1_ps(Minimum), r = _mm256_set1_ps(Range),
+        mx = _mm256_set1_ps(Max), top = _mm256_set1_ps(Max - 1);
+    size_t k = 0;
+    for (; k + 16 <= Count; k += 16) {
+        __m256i a = avx2_quantize(Src + k, mn, r, mx, top);
+        __m256i b = avx2_quantize(Src + k + 8, mn, r, mx, top);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + 2 * k),
+            avx2_swap16(avx2_pack16(a, b)));
+    }
+    sse2_16be(Dst + 2 * k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+__attribute__((target("avx2")))
+static void avx2_16le(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const __m256 mn = _mm256_set1_ps(Minimum), r = _mm256_set1_ps(Range),
+        mx = _mm256_set1_ps(Max), top = _mm256_set1_ps(Max - 1);
+    size_t k = 0;
+    for (; k + 16 <= Count; k += 16) {
+        __m256i a = avx2_quantize(Src + k, mn, r, mx, top);
+        __m256i b = avx2_quantize(Src + k + 8, mn, r, mx, top);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + 2 * k),
+            avx2_pack16(a, b));
+    }
+    sse2_16le(Dst + 2 * k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+__attribute__((target("avx2")))
+static inline int avx2_exact(const float* Src, __m256 Top, __m256i& Out) {
+    __m256 v = _mm256_loadu_ps(Src);
+    Out = _mm256_cvttps_epi32(v);
+    __m256 ok = _mm256_and_ps(
+        _mm256_cmp_ps(_mm256_cvtepi32_ps(Out), v, _CMP_EQ_OQ),
+        _mm256_and_ps(_mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GE_OQ),
+            _mm256_cmp_ps(v, Top, _CMP_LE_OQ)));
+    return _mm256_movemask_ps(ok);
+}
+
+__attribute__((target("avx2")))
+static void avx2_identity8(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const __m256 top = _mm256_set1_ps(Range);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t k = 0;
+    for (; k + 32 <= Count; k += 32) {
+        __m256i a, b, c, d;
+        if ((avx2_exact(Src + k, top, a) & avx2_exact(Src + k + 8, top, b) &
+            avx2_exact(Src + k + 16, top, c) &
+            avx2_exact(Src + k + 24, top, d)) != 0xff)
+        {
+            avx2_8(Dst + k, Src + k, 32, Minimum, Range, Max);
+            continue;
+        }
+        __m256i v = _mm256_packus_epi16(
+            _mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + k),
+            _mm256_permutevar8x32_epi32(v, order));
+    }
+    sse2_identity8(Dst + k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+__attribute__((target("avx2")))
+static void avx2_identity16be(unsigned char* Dst, const float* Src,
+    size_t Count, float Minimum, float Range, float Max)
+{
+    const __m256 top = _mm256_set1_ps(Range);
+    size_t k = 0;
+    for (; k + 16 <= Count; k += 16) {
+        __m256i a, b;
+        if ((avx2_exact(Src + k, top, a) & avx2_exact(Src + k + 8, top, b))
+            != 0xff)
+        {
+            avx2_16be(Dst + 2 * k, Src + k, 16, Minimum, Range, Max);
+            continue;
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + 2 * k),
+            avx2_swap16(avx2_pack16(a, b)));
+    }
+    sse2_identity16be(Dst + 2 * k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+__attribute__((target("avx2")))
+static void avx2_identity16le(unsigned char* Dst, const float* Src,
+    size_t Count, float Minimum, float Range, float Max)
+{
+    const __m256 top = _mm256_set1_ps(Range);
+    size_t k = 0;
+    for (; k + 16 <= Count; k += 16) {
+        __m256i a, b;
+        if ((avx2_exact(Src + k, top, a) & avx2_exact(Src + k + 8, top, b))
+            != 0xff)
+        {
+            avx2_16le(Dst + 2 * k, Src + k, 16, Minimum, Range, Max);
+            continue;
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + 2 * k),
+            avx2_pack16(a, b));
+    }
+    sse2_identity16le(Dst + 2 * k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+static const Kernels avx2 = { "avx2", &avx2_8, &avx2_16be, &avx2_16le,
+    &avx2_identity8, &avx2_identity16be, &avx2_identity16le };
+
+// Zero-masked forms with all lanes selected are used where the plain
+// intrinsics pass an undefined source that GCC warns about.
+static const __mmask16 avx512_all = 0xffff;
+
+__attribute__((target("avx512f")))
+static inline __m512i avx512_quantize(const float* Src,
+    __m512 Minimum, __m512 Range, __m512 Max, __m512 Top)
+{
+    __m512 v = _mm512_div_ps(
+        _mm512_sub_ps(_mm512_loadu_ps(Src), Minimum), Range);
+    v = _mm512_maskz_min_ps(avx512_all,
+        _mm512_maskz_max_ps(avx512_all, v, _mm512_setzero_ps()),
+        _mm512_set1_ps(1.0f));
+    return _mm512_maskz_cvttps_epi32(avx512_all,
+        _mm512_maskz_min_ps(avx512_all, _mm512_mul_ps(v, Max), Top));
+}
+
+__attribute__((target("avx512f")))
+static void avx512_8(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const __m512 mn = _mm512_set1_ps(Minimum), r = _mm512_set1_ps(Range),
+        mx = _mm512_set1_ps(Max), top = _mm512_set1_ps(Max - 1);
+    size_t k = 0;
+    for (; k + 16 <= Count; k += 16)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + k),
+            _mm512_maskz_cvtusepi32_epi8(avx512_all,
+                avx512_quantize(Src + k, mn, r, mx, top)));
+    avx2_8(Dst + k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+__attribute__((target("avx512f")))
+static void avx512_16be(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const __m512 mn = _mm512_set1_ps(Minimum), r = _mm512_set1_ps(Range),
+        mx = _mm512_set1_ps(Max), top = _mm512_set1_ps(Max - 1);
+    size_t k = 0;
+    for (; k + 16 <= Count; k += 16)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + 2 * k),
+            avx2_swap16(_mm512_maskz_cvtusepi32_epi16(avx512_all,
+                avx512_quantize(Src + k, mn, r, mx, top))));
+    avx2_16be(Dst + 2 * k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+__attribute__((target("avx512f")))
+static void avx512_16le(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const __m512 mn = _mm512_set1_ps(Minimum), r = _mm512_set1_ps(Range),
+        mx = _mm512_set1_ps(Max), top = _mm512_set1_ps(Max - 1);
+    size_t k = 0;
+    for (; k + 16 <= Count; k += 16)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + 2 * k),
+            _mm512_maskz_cvtusepi32_epi16(avx512_all,
+                avx512_quantize(Src + k, mn, r, mx, top)));
+    avx2_16le(Dst + 2 * k, Src + k, Count - k, Minimum, Range, Max);
+}
+
+// Identity conversion is limited by memory bandwidth already with AVX2.
+static const Kernels avx512 = {
+    "avx512f", &avx512_8, &avx512_16be, &avx512_16le,
+    &avx2_identity8, &avx2_identity16be, &avx2_identity16le };
+
+#endif
+
+// Kernels the processor can run, fastest first.
+static std::vector<const Kernels*> available_kernels() {
+    std::vector<const Kernels*> found;
+#if defined(QUANTIZE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        found.push_back(&avx512);
+    if (__builtin_cpu_supports("avx2"))
+        found.push_back(&avx2);
+    if (__builtin_cpu_supports("sse2"))
+        found.push_back(&sse2);
+#endif
+    found.push_back(&scalar);
+    return found;
+}
+
+static const Kernels& kernels() {
+    static const Kernels* selected = available_kernels().front();
+    return *selected;
+}
+
+// Range [0, Max - 1] maps integers to themselves, as with readimage output
+// written back in the same depth.
+static bool identity(float Minimum, float Range, float Max) {
+    return Minimum == 0.0f && Range == Max - 1.0f;
+}
+
+void quantize8(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const Kernels& k = kernels();
+    (identity(Minimum, Range, Max) ? k.i8 : k.q8)(
+        Dst, Src, Count, Minimum, Range, Max);
+}
+
+void quantize16be(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const Kernels& k = kernels();
+    (identity(Minimum, Range, Max) ? k.i16be : k.q16be)(
+        Dst, Src, Count, Minimum, Range, Max);
+}
+
+void quantize16le(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max)
+{
+    const Kernels& k = kernels();
+    (identity(Minimum, Range, Max) ? k.i16le : k.q16le)(
+        Dst, Src, Count, Minimum, Range, Max);
+}
+
+const char* quantize_isa() {
+    return kernels().name;
+}
+
+// Pixels are separate vectors, so gather the row into contiguous floats.
+static const std::vector<float>& flatten(
+    const std::vector<std::vector<float>>& Row)
+{
+    thread_local std::vector<float> flat;
+    flat.resize(0);
+    for (auto& pixel : Row)
+        flat.insert(flat.end(), pixel.begin(), pixel.end());
+    return flat;
+}
+
+void Quantizer::pack8(unsigned char* Dst,
+    const std::vector<std::vector<float>>& Row) const
+{
+    const std::vector<float>& flat = flatten(Row);
+    quantize8(Dst, flat.data(), flat.size(), minimum, range, max);
+}
+
+void Quantizer::pack16be(unsigned char* Dst,
+    const std::vector<std::vector<float>>& Row) const
+{
+    const std::vector<float>& flat = flatten(Row);
+    quantize16be(Dst, flat.data(), flat.size(), minimum, range, max);
+}
+
+void Quantizer::pack16(unsigned char* Dst,
+    const std::vector<std::vector<float>>& Row) const
+{
+    const std::vector<float>& flat = flatten(Row);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    quantize16be(Dst, flat.data(), flat.size(), minimum, range, max);
+#else
+    quantize16le(Dst, flat.data(), flat.size(), minimum, range, max);
+#endif
+}
+
+#if defined(BENCHMARK)
+
+// Previous way of packing, one component at a time after scaling.
+static void baseline8(std::vector<char>& Out, const std::vector<float>& Src,
+    float Minimum, float Range, float Max)
+{
+    Out.resize(0);
+    for (auto& component : Src)
+        Out.push_back(static_cast<char>(static_cast<unsigned char>(
+            quantize_value(component, Minimum, Range, Max))));
+}
+
+template<typename Func>
+static double best_seconds(Func F) {
+    double best = 0.0;
+    for (int k = 0; k < 5; ++k) {
+        auto start = std::chrono::steady_clock::now();
+        F();
+        std::chrono::duration<double> d =
+            std::chrono::steady_clock::now() - start;
+        if (k == 0 || d.count() < best)
+            best = d.count();
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    const size_t count = size_t(1) << 24;
+    std::vector<float> src(count);
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<float> dist(-0.1f, 1.1f);
+    for (auto& v : src)
+        v = dist(gen);
+    std::vector<unsigned char> dst(2 * count);
+    std::vector<char> base;
+    auto report = [&](const char* Name, const char* Op, double Seconds) {
+        std::cout << Name << ' ' << Op << ' '
+            << (count / Seconds) * 1e-6 << " Mcomponents/s\n";
+    };
+    report("baseline", "push_back8", best_seconds(
+        [&]() { baseline8(base, src, 0.0f, 1.0f, 256.0f); }));
+    for (const Kernels* k : available_kernels()) {
+        report(k->name, "8", best_seconds([&]() {
+            k->q8(dst.data(), src.data(), count, 0.0f, 1.0f, 256.0f); }));
+        report(k->name, "16be", best_seconds([&]() {
+            k->q16be(dst.data(), src.data(), count, 0.0f, 1.0f, 65536.0f); }));
+        report(k->name, "16le", best_seconds([&]() {
+            k->q16le(dst.data(), src.data(), count, 0.0f, 1.0f, 65536.0f); }));
+    }
+    // Integer values as read from 8- and 16-bit images. Rows are packed
+    // from a copy in cache so one row-sized block is used repeatedly.
+    const size_t row = 8192;
+    std::vector<float> ints8(row), ints16(row);
+    std::uniform_int_distribution<int> byte(0, 255), word(0, 65535);
+    for (size_t k = 0; k < row; ++k) {
+        ints8[k] = float(byte(gen));
+        ints16[k] = float(word(gen));
+    }
+    auto rows = [&](QuantizeFunc F, const std::vector<float>& Src, float Max) {
+        return best_seconds([&]() {
+            for (size_t k = 0; k < count; k += row)
+                F(dst.data(), Src.data(), row, 0.0f, Max - 1.0f, Max);
+        });
+    };
+    for (const Kernels* k : available_kernels()) {
+        report(k->name, "8 integer rows", rows(k->q8, ints8, 256.0f));
+        report(k->name, "identity8 rows", rows(k->i8, ints8, 256.0f));
+        report(k->name, "16le integer rows", rows(k->q16le, ints16, 65536.0f));
+        report(k->name, "identity16le rows",
+            rows(k->i16le, ints16, 65536.0f));
+    }
+    std::cout << "selected " << quantize_isa() << std::endl;
+    return 0;
+}
+
+#endif
+
+#if defined(UNITTEST)
+
+static std::vector<float> test_values(float Minimum, float Range) {
+    std::vector<float> values { 0.0f, -0.0f, -1.0f, 1.0f, 0.5f, 0.25f,
+        Minimum, Minimum + Range, Minimum - Range, Minimum + 2 * Range,
+        std::nextafter(Minimum + Range, Minimum),
+        std::nextafter(Minimum, Minimum + Range + 1.0f),
+        INFINITY, -INFINITY, 1e30f, -1e30f };
+    for (int k = 0; k < 1000; ++k)
+        values.push_back(Minimum + Range * ((k - 100) / 800.0f));
+    return values;
+}
+
+TEST_CASE("quantize kernels match quantize_value") {
+    const float ranges[][2] = { { 0.0f, 1.0f }, { -3.0f, 7.0f },
+        { 0.0f, 256.0f }, { 0.0f, 65536.0f }, { 2.0f, 2.0f },
+        { 0.1f, 0.3f } };
+    for (const Kernels* k : available_kernels()) {
+        for (auto& mm : ranges) {
+            float range = mm[1] - mm[0];
+            std::vector<float> values = test_values(mm[0], range);
+            // Vary count to cover tails of all vector widths.
+            for (size_t count = values.size() - 40; count <= values.size();
+                ++count)
+            {
+                for (int depth = 1; depth <= 16; ++depth) {
+                    float max = float(1 << depth);
+                    std::vector<unsigned char> expected(2 * count + 1, 0xcd);
+                    std::vector<unsigned char> got(2 * count + 1, 0xcd);
+                    INFO(k->name << " depth " << depth << " count " << count
+                        << " range " << mm[0] << ", " << mm[1]);
+                    if (depth <= 8) {
+                        scalar8(expected.data(), values.data(), count,
+                            mm[0], range, max);
+                        k->q8(got.data(), values.data(), count,
+                            mm[0], range, max);
+                        REQUIRE(got == expected);
+                    }
+                    scalar16be(expected.data(), values.data(), count,
+                        mm[0], range, max);
+                    k->q16be(got.data(), values.data(), count,
+                        mm[0], range, max);
+                    REQUIRE(got == expected);
+                    scalar16le(expected.data(), values.data(), count,
+                        mm[0], range, max);
+                    k->q16le(got.data(), values.data(), count,
+                        mm[0], range, max);
+                    REQUIRE(got == expected);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("identity kernels map integers to themselves") {
+    for (const Kernels* k : available_kernels()) {
+        for (int depth = 1; depth <= 16; ++depth) {
+            const float max = float(1 << depth), top = max - 1.0f;
+            std::vector<float> values;
+            for (int v = 0; v < (1 << depth); ++v)
+                values.push_back(float(v));
+            // Values that are not integers in range use the general kernel.
+            const float others[] = { 0.5f, -1.0f, -0.0f, top + 1.0f,
+                std::nextafter(top, 0.0f), 1e30f, -1e30f, NAN, INFINITY };
+            for (size_t n = 0; n < sizeof(others) / sizeof(others[0]); ++n)
+                values.insert(values.begin() + (n * 37) % values.size(),
+                    others[n]);
+            // Vary count to cover tails of all vector widths.
+            size_t first = (40 < values.size()) ? values.size() - 40 : 1;
+            for (size_t count = first; count <= values.size(); ++count) {
+                std::vector<unsigned char> expected(2 * count + 1, 0xcd);
+                std::vector<unsigned char> got(2 * count + 1, 0xcd);
+                INFO(k->name << " depth " << depth << " count " << count);
+                for (size_t n = 0; n < count; ++n) {
+                    float v = values[n];
+                    if (!exact(v, top))
+                        v = quantize_value(v, 0.0f, top, max);
+                    std::uint16_t val = static_cast<std::uint16_t>(v);
+                    if (depth <= 8)
+                        expected[n] = static_cast<unsigned char>(val);
+                    else {
+                        expected[2 * n] = static_cast<unsigned char>(val >> 8);
+                        expected[2 * n + 1] = static_cast<unsigned char>(val);
+                    }
+                }
+                if (depth <= 8) {
+                    k->i8(got.data(), values.data(), count, 0.0f, top, max);
+                    REQUIRE(got == expected);
+                    continue;
+                }
+                k->i16be(got.data(), values.data(), count, 0.0f, top, max);
+                REQUIRE(got == expected);
+                for (size_t n = 0; n < count; ++n)
+                    std::swap(expected[2 * n], expected[2 * n + 1]);
+                k->i16le(got.data(), values.data(), count, 0.0f, top, max);
+                REQUIRE(got == expected);
+            }
+        }
+    }
+}
+
+TEST_CASE("Quantizer packs rows of pixels") {
+    std::vector<std::vector<float>> row;
+    for (int k = 0; k < 37; ++k)
+        row.push_back(std::vector<float> { k / 36.0f, 1.0f - k / 36.0f });
+    Quantizer q(0.0f, 1.0f, 16);
+    std::vector<unsigned char> out(row.size() * 2 * 2);
+    q.pack16be(out.data(), row);
+    for (size_t k = 0; k < row.size(); ++k)
+        for (size_t c = 0; c < 2; ++c) {
+            unsigned int val = (out[4 * k + 2 * c] << 8) | out[4 * k + 2 * c + 1];
+            REQUIRE(val == static_cast<unsigned int>(q(row[k][c])));
+        }
+}
+
+#endif
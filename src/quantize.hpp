@@ -0,0 +1,97 @@
+//
+//  quantize.hpp
+//
+//  Created by Ismo Kärkkäinen on 18.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+// Maps component values from given range to output bit depth and packs rows
+// of pixels into output byte order in the same pass.
+
+#if !defined(QUANTIZE_HPP)
+#define QUANTIZE_HPP
+
+#include "parallel.hpp"
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+
+
+// Maps Value - Minimum in [0, Range] to integer in [0, Max - 1].
+inline float quantize_value(float Value, float Minimum, float Range, float Max)
+{
+    Value -= Minimum;
+    if (Value <= 0.0f)
+        return 0.0f;
+    if (Range <= Value)
+        Value = 1.0f;
+    else {
+        Value /= Range;
+        if (1.0f < Value)
+            Value = 1.0f;
+    }
+    Value = std::trunc(Value * Max);
+    return (Value == Max) ? Max - 1 : Value;
+}
+
+// Kernels that quantize Count values from Src and pack them to Dst. Fastest
+// available instruction set is chosen at first call. Result is the same as
+// with quantize_value for all values except NaN.
+void quantize8(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max);
+void quantize16be(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max);
+void quantize16le(unsigned char* Dst, const float* Src, size_t Count,
+    float Minimum, float Range, float Max);
+// Name of the instruction set the kernels use.
+const char* quantize_isa();
+
+class Quantizer {
+private:
+    float minimum, range, max;
+
+public:
+    // Maps [Minimum, Maximum] to [0, 2^Depth - 1].
+    Quantizer(float Minimum, float Maximum, int Depth)
+        : minimum(Minimum), range(Maximum - Minimum), max(float(1 << Depth))
+    { }
+
+    // Returns integer value as float. Integers map to themselves when range
+    // is [0, 2^Depth - 1], as in the kernels.
+    float operator()(float Component) const {
+        if (minimum == 0.0f && range == max - 1.0f && 0.0f <= Component &&
+            Component <= range && Component == std::trunc(Component))
+                return Component;
+        return quantize_value(Component, minimum, range, max);
+    }
+
+    // Packs row into Dst, one byte per component.
+    void pack8(unsigned char* Dst,
+        const std::vector<std::vector<float>>& Row) const;
+    // Packs row into Dst, two bytes per component, most significant first.
+    void pack16be(unsigned char* Dst,
+        const std::vector<std::vector<float>>& Row) const;
+    // Packs row into Dst, two bytes per component in native byte order.
+    void pack16(unsigned char* Dst,
+        const std::vector<std::vector<float>>& Row) const;
+
+    typedef void (Quantizer::*Packer)(unsigned char* Dst,
+        const std::vector<std::vector<float>>& Row) const;
+
+    // Packs Rows[Begin, End) into Dst, RowBytes apart, in parallel.
+    template<typename Image>
+    void pack_rows(ThreadPool& Pool, Packer Pack, unsigned char* Dst,
+        size_t RowBytes, const Image& Rows, size_t Begin, size_t End) const
+    {
+        size_t min_rows = (RowBytes < 65536) ? 65536 / RowBytes : 1;
+        Pool.Ranges(End - Begin, min_rows,
+            [&](size_t Part, size_t First, size_t Last) {
+                for (size_t r = First; r < Last; ++r)
+                    (this->*Pack)(Dst + r * RowBytes, Rows[Begin + r]);
+            });
+    }
+};
+
+#endif
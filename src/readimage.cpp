@@ -7,6 +7,7 @@
 // Licensed under Universal Permissive License. See License.txt.
 
 #include "convenience.hpp"
+#include "parallel.hpp"
 #include <iostream>
 #include <fcntl.h>
 #include <unistd.h>
@@ -17,6 +18,7 @@
 #include <cstddef>
 #include <iterator>
 #include <cstdint>
+#include <algorithm>
 #if !defined(NO_TIFF)
 #include <stdio.h>
 #include <tiffio.h>
@@ -95,25 +97,56 @@ static int read_tiff(
             return -3;
         }
     }
-    std::unique_ptr<void,void (*)(void*)> buffer(
-        _TIFFmalloc(TIFFScanlineSize(t)), &_TIFFfree);
-    image.resize(height);
-    std::uint32_t row = 0;
-    for (auto& line : image) {
-        line.resize(width);
-        if (-1 == TIFFReadScanline(t, buffer.get(), row++))
-            return -4;
-        unsigned char* curr = reinterpret_cast<unsigned char*>(buffer.get());
-        for (auto& pixel : line) {
+    auto convert = [&](std::vector<std::vector<float>>& Line, size_t First,
+        size_t Count, const unsigned char* curr)
+    {
+        for (size_t k = First; k < First + Count; ++k) {
+            auto& pixel = Line[k];
             pixel.resize(samples);
             for (auto& component : pixel)
                 if (bits == 8)
                     component = float(*curr++);
                 else {
-                    component = float(*reinterpret_cast<std::uint16_t*>(curr));
+                    component = float(
+                        *reinterpret_cast<const std::uint16_t*>(curr));
                     curr += 2;
                 }
         }
+    };
+    image.resize(height);
+    for (auto& line : image)
+        line.resize(width);
+    if (TIFFIsTiled(t)) {
+        std::uint32_t tile_width, tile_length;
+        TIFFGetField(t, TIFFTAG_TILEWIDTH, &tile_width);
+        TIFFGetField(t, TIFFTAG_TILELENGTH, &tile_length);
+        std::unique_ptr<void,void (*)(void*)> buffer(
+            _TIFFmalloc(TIFFTileSize(t)), &_TIFFfree);
+        const size_t tile_row = size_t(tile_width) * samples * (bits / 8);
+        for (std::uint32_t y = 0; y < height; y += tile_length)
+            for (std::uint32_t x = 0; x < width; x += tile_width) {
+                if (-1 == TIFFReadTile(t, buffer.get(), x, y, 0, 0))
+                    return -4;
+                const unsigned char* tile =
+                    reinterpret_cast<unsigned char*>(buffer.get());
+                for (std::uint32_t r = y; r < height && r < y + tile_length;
+                    ++r)
+                {
+                    convert(image[r], x, std::min(tile_width, width - x),
+                        tile + (r - y) * tile_row);
+                }
+            }
+        TIFFClose(t);
+        return 0;
+    }
+    std::unique_ptr<void,void (*)(void*)> buffer(
+        _TIFFmalloc(TIFFScanlineSize(t)), &_TIFFfree);
+    std::uint32_t row = 0;
+    for (auto& line : image) {
+        if (-1 == TIFFReadScanline(t, buffer.get(), row++))
+            return -4;
+        convert(line, 0, width,
+            reinterpret_cast<unsigned char*>(buffer.get()));
     }
     TIFFClose(t);
     return 0;
@@ -246,7 +279,7 @@ public:
         bytes = (8 < bit_depth) ? 2 : 1;
         for (png_uint_32 k = 0; k < height; k++)
             raw.push_back(std::unique_ptr<png_byte>(
-                new png_byte[channels * width * bytes]));
+                new png_byte[size_t(channels) * width * bytes]));
     }
 
     void row_callback(png_structp png, png_bytep buffer,
@@ -311,7 +344,149 @@ static const char* readPNG(
 }
 #endif
 
-// PPM, NetPBM color image binary format.
+// PPM, PGM and PAM, NetPBM binary formats, and PPM text format.
+
+static const char* skip_line(const char* curr, const char* last) {
+    while (curr != last && *curr != '\n')
+        ++curr;
+    return (curr == last) ? nullptr : curr + 1;
+}
+
+// PAM header has lines of keyword and value, ends with line ENDHDR.
+static int read_pam_header(const char*& curr, const char* last,
+    io::ParseInt32::Type& width, io::ParseInt32::Type& height,
+    io::ParseInt32::Type& depth, io::ParseInt32::Type& maxval)
+{
+    io::ParserPool pp;
+    io::ParseInt32 p;
+    width = height = depth = maxval = 0;
+    while (true) {
+        curr = p.skipWhitespace(curr, last);
+        if (curr == nullptr)
+            return -4;
+        const char* keyword = curr;
+        while (curr != last && !p.isWhitespace(*curr))
+            ++curr;
+        std::string key(keyword, curr);
+        if (key == "ENDHDR") {
+            if (curr == last || *curr != '\n')
+                return -4;
+            ++curr;
+            return 0;
+        }
+        io::ParseInt32::Type* target = nullptr;
+        if (key == "WIDTH")
+            target = &width;
+        else if (key == "HEIGHT")
+            target = &height;
+        else if (key == "DEPTH")
+            target = &depth;
+        else if (key == "MAXVAL")
+            target = &maxval;
+        if (target == nullptr) {
+            // Comments and TUPLTYPE do not affect how data is read.
+            curr = skip_line(curr, last);
+            if (curr == nullptr)
+                return -4;
+            continue;
+        }
+        curr = p.skipWhitespace(curr, last);
+        if (curr == nullptr)
+            return -4;
+        curr = p.Parse(curr, last, pp);
+        if (curr == nullptr || !p.isWhitespace(*curr))
+            return -4;
+        *target = std::get<io::ParserPool::Int32>(pp.Value);
+    }
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' ||
+        c == '\v' || c == '\f';
+}
+
+// Scans whitespace-separated unsigned integers. Part has to start and end at
+// whitespace or at the ends of the text so that no number is split.
+static int scan_plain(std::vector<float>& values,
+    const char* curr, const char* end)
+{
+    while (curr != end) {
+        if (is_space(*curr)) {
+            ++curr;
+            continue;
+        }
+        if (*curr < '0' || '9' < *curr)
+            return -7;
+        std::uint32_t value = 0;
+        do {
+            value = value * 10 + static_cast<std::uint32_t>(*curr++ - '0');
+            if (65535 < value)
+                return -7;
+        } while (curr != end && '0' <= *curr && *curr <= '9');
+        if (curr != end && !is_space(*curr))
+            return -6;
+        values.push_back(float(value));
+    }
+    return 0;
+}
+
+// Splits the text at whitespace and scans the parts in parallel.
+static int read_plain_ppm(const char* curr, const char* last, Image& image,
+    io::ParseInt32::Type width, io::ParseInt32::Type height)
+{
+    const size_t parts = part_count(last - curr, 1 << 20);
+    std::vector<const char*> bounds(parts + 1, last);
+    bounds[0] = curr;
+    for (size_t k = 1; k < parts; ++k) {
+        const char* b = curr + ((last - curr) * k) / parts;
+        if (b < bounds[k - 1])
+            b = bounds[k - 1];
+        while (b != last && !is_space(*b))
+            ++b;
+        bounds[k] = b;
+    }
+    std::vector<std::vector<float>> values(parts);
+    std::vector<int> status(parts, 0);
+    parallel_ranges(parts, parts, [&](size_t Part, size_t Begin, size_t End) {
+        for (size_t k = Begin; k < End; ++k) {
+            values[k].reserve((bounds[k + 1] - bounds[k]) / 2);
+            status[k] = scan_plain(values[k], bounds[k], bounds[k + 1]);
+        }
+    });
+    std::vector<size_t> offsets(parts + 1, 0);
+    for (size_t k = 0; k < parts; ++k) {
+        if (status[k] != 0)
+            return status[k];
+        offsets[k + 1] = offsets[k] + values[k].size();
+    }
+    const size_t row_size = size_t(width) * 3;
+    if (offsets.back() < row_size * size_t(height))
+        return -7;
+    image.resize(height);
+    parallel_ranges(height, part_count(height, 16),
+        [&](size_t Part, size_t Begin, size_t End) {
+            // Find the part that holds the first value of the first row.
+            size_t src = 0;
+            while (offsets[src + 1] <= Begin * row_size)
+                ++src;
+            size_t idx = Begin * row_size - offsets[src];
+            for (size_t r = Begin; r < End; ++r) {
+                auto& line = image[r];
+                line.resize(width);
+                for (auto& pixel : line) {
+                    pixel.resize(3);
+                    for (auto& component : pixel) {
+                        while (values[src].size() <= idx) {
+                            idx = 0;
+                            ++src;
+                        }
+                        component = values[src][idx++];
+                    }
+                }
+            }
+        });
+    return 0;
+}
 
 static int read_ppm(const io::ReadImageIn::filenameType& filename, Image& image)
 {
@@ -324,68 +499,79 @@ static int read_ppm(const io::ReadImageIn::filenameType& filename, Image& image)
         return -3;
     if (contents[0] != static_cast<std::byte>('P'))
         return -3;
-    bool binary = contents[1] == static_cast<std::byte>('6');
-    if (!binary && contents[1] != static_cast<std::byte>('3'))
+    io::ParseInt32::Type channels = 3;
+    bool binary = true;
+    bool pam = false;
+    switch (static_cast<char>(contents[1])) {
+    case '3': binary = false; break;
+    case '5': channels = 1; break;
+    case '6': break;
+    case '7': pam = true; break;
+    default:
         return -3;
+    }
     if (!binary)
         contents.push_back(std::byte(0));
     io::ParseInt32::Type width, height, maxval;
     const char* last = reinterpret_cast<const char*>(&contents.back());
     const char* curr = reinterpret_cast<const char*>(&contents.front() + 2);
     size_t idx = 0;
-    // Comment lines are not supported in the file.
+    // Comment lines are not supported in the file, except in PAM header.
     io::ParserPool pp;
     io::ParseInt32 p;
     try {
-        curr = p.skipWhitespace(curr, last);
-        curr = p.Parse(curr, last, pp);
-        if (curr == nullptr || !p.isWhitespace(*curr))
-            return -4;
-        width = std::get<io::ParserPool::Int32>(pp.Value);
-        curr = p.skipWhitespace(curr, last);
-        curr = p.Parse(curr, last, pp);
-        if (curr == nullptr || !p.isWhitespace(*curr))
-            return -4;
-        height = std::get<io::ParserPool::Int32>(pp.Value);
-        curr = p.skipWhitespace(curr, last);
-        curr = p.Parse(curr, last, pp);
-        if (curr == nullptr || !p.isWhitespace(*curr))
-            return -4;
-        maxval = std::get<io::ParserPool::Int32>(pp.Value);
+        if (pam) {
+            status = read_pam_header(curr, last, width, height, channels, maxval);
+            if (status != 0)
+                return status;
+            if (channels <= 0)
+                return -4;
+        } else {
+            curr = p.skipWhitespace(curr, last);
+            curr = p.Parse(curr, last, pp);
+            if (curr == nullptr || !p.isWhitespace(*curr))
+                return -4;
+            width = std::get<io::ParserPool::Int32>(pp.Value);
+            curr = p.skipWhitespace(curr, last);
+            curr = p.Parse(curr, last, pp);
+            if (curr == nullptr || !p.isWhitespace(*curr))
+                return -4;
+            height = std::get<io::ParserPool::Int32>(pp.Value);
+            curr = p.skipWhitespace(curr, last);
+            curr = p.Parse(curr, last, pp);
+            if (curr == nullptr || !p.isWhitespace(*curr))
+                return -4;
+            maxval = std::get<io::ParserPool::Int32>(pp.Value);
+            if (binary)
+                curr++; // Skip whitespace.
+        }
         if (width <= 0 || height <= 0 || maxval <= 0 || 65535 < maxval)
             return -4;
         if (binary) {
-            curr++; // Skip whitespace.
             idx = reinterpret_cast<const std::byte*>(curr) - &contents.front();
-            if (static_cast<int>(contents.size() - idx) != width * height * ((maxval < 256) ? 3 : 6))
-                return -5;
+            // In 64 bits as the product can exceed 32-bit range.
+            if (contents.size() - idx != size_t(width) * size_t(height) *
+                size_t(channels) * ((maxval < 256) ? 1 : 2))
+                    return -5;
         }
     }
     catch (const io::Exception& e) {
         return -4;
     }
+    if (!binary)
+        return read_plain_ppm(curr, last, image, width, height);
     image.resize(height);
     for (auto& line : image) {
         line.resize(width);
         for (auto& pixel : line) {
-            pixel.resize(3);
+            pixel.resize(channels);
             for (auto& component : pixel)
-                if (binary) {
-                    if (maxval < 256) {
-                        component = float(contents[idx]);
-                        ++idx;
-                    } else {
-                        component = float(contents[idx]) * 256 + float(contents[idx + 1]);
-                        idx += 2;
-                    }
+                if (maxval < 256) {
+                    component = float(contents[idx]);
+                    ++idx;
                 } else {
-                    curr = p.skipWhitespace(curr, last);
-                    if (curr == nullptr)
-                        return -6;
-                    curr = p.Parse(curr, last, pp);
-                    if (curr == nullptr)
-                        return -7;
-                    component = std::get<io::ParserPool::Int32>(pp.Value);
+                    component = float(contents[idx]) * 256 + float(contents[idx + 1]);
+                    idx += 2;
                 }
         }
     }
@@ -402,11 +588,11 @@ static const char* readPPM(
     case 0: return nullptr;
     case -1: return "Failed to open file.";
     case -2: return "Failed to get file size.";
-    case -3: return "Not PPM.";
+    case -3: return "Not PPM, PGM, or PAM.";
     case -4: return "Invalid header.";
     case -5: return "File and header size mismatch.";
     case -6: return "No whitespace when expected.";
-    case -7: return "No number when expected.";
+    case -7: return "No number in range when expected.";
     }
     return "Unspecified error.";
 }
@@ -439,7 +625,11 @@ static int read_image(io::ReadImageIn& Val) {
         shift = Val.maximum();
     if (strcasecmp(Val.format().c_str(), "ppm") == 0 ||
         strcasecmp(Val.format().c_str(), "p6-ppm") == 0 ||
-        strcasecmp(Val.format().c_str(), "p3-ppm") == 0)
+        strcasecmp(Val.format().c_str(), "p3-ppm") == 0 ||
+        strcasecmp(Val.format().c_str(), "pgm") == 0 ||
+        strcasecmp(Val.format().c_str(), "p5-pgm") == 0 ||
+        strcasecmp(Val.format().c_str(), "pam") == 0 ||
+        strcasecmp(Val.format().c_str(), "p7-pam") == 0)
             reader = &readPPM;
 #if !defined(NO_TIFF)
     else if (strcasecmp(Val.format().c_str(), "tiff") == 0 ||
@@ -0,0 +1,407 @@
+//
+//  sink.hpp
+//
+//  Created by Ismo Kärkkäinen on 18.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+// Destinations for encoded output, written piece by piece or in place.
+
+#if !defined(SINK_HPP)
+#define SINK_HPP
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+
+// Writes Length bytes to the file. Returns false on error.
+inline bool write_all(int fd, const unsigned char* Data, size_t Length) {
+    while (Length) {
+        ssize_t count = write(fd, Data, Length);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        Data += count;
+        Length -= count;
+    }
+    return true;
+}
+
+// Writes Length bytes at Offset in the file. Returns false on error.
+inline bool pwrite_all(int fd, const unsigned char* Data, size_t Length,
+    std::uint64_t Offset)
+{
+    while (Length) {
+        ssize_t count = pwrite(fd, Data, Length, static_cast<off_t>(Offset));
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        Data += count;
+        Length -= count;
+        Offset += count;
+    }
+    return true;
+}
+
+// Writes Parts in order, as many per writev call as allowed. Parts are
+// changed to track progress. Returns false on error.
+inline bool writev_all(int fd, std::vector<iovec>& Parts) {
+    size_t first = 0;
+    while (first < Parts.size()) {
+        size_t count = Parts.size() - first;
+        if (IOV_MAX < count)
+            count = IOV_MAX;
+        ssize_t written = writev(fd, &Parts[first], static_cast<int>(count));
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        size_t left = static_cast<size_t>(written);
+        while (first < Parts.size() && Parts[first].iov_len <= left)
+            left -= Parts[first++].iov_len;
+        if (first < Parts.size()) {
+            Parts[first].iov_base =
+                static_cast<char*>(Parts[first].iov_base) + left;
+            Parts[first].iov_len -= left;
+        }
+    }
+    return true;
+}
+
+class ByteSink {
+public:
+    virtual ~ByteSink() { }
+    // Appends Length bytes. Returns false on error.
+    virtual bool Write(const unsigned char* Data, size_t Length) = 0;
+    // Overwrites bytes already written, for values known only at the end.
+    virtual bool WriteAt(std::uint64_t Offset, const unsigned char* Data,
+        size_t Length) = 0;
+};
+
+class MemorySink : public ByteSink {
+public:
+    std::vector<unsigned char> data;
+
+    bool Write(const unsigned char* Data, size_t Length) {
+        data.insert(data.end(), Data, Data + Length);
+        return true;
+    }
+
+    bool WriteAt(std::uint64_t Offset, const unsigned char* Data,
+        size_t Length)
+    {
+        if (data.size() < Offset + Length)
+            return false;
+        memcpy(&data[Offset], Data, Length);
+        return true;
+    }
+};
+
+// Writes queued buffers to files in a background thread, so that encoding
+// continues while earlier output is written. At most Limit bytes wait in the
+// queue. Files are referred to by the number Open returns. A regular file
+// that could not be written is removed when it is closed.
+class WriteBehind {
+private:
+    enum Kind { Appending, Placing, Closing };
+    struct Job {
+        size_t file;
+        Kind kind;
+        std::uint64_t offset;
+        std::vector<unsigned char> data;
+    };
+    struct File {
+        int fd;
+        std::string name;
+        bool failed, closed;
+    };
+    // Written buffers up to this size are kept for reuse.
+    const size_t spare_size = size_t(2) << 20;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Job> jobs;
+    std::deque<File> files;
+    size_t first, queued, limit;
+    std::vector<std::vector<unsigned char>> spare;
+    bool stop;
+    std::thread worker;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this]() { return stop || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            File& f = files[job.file - first];
+            bool ok = !f.failed;
+            lock.unlock();
+            if (job.kind == Appending && ok)
+                ok = write_all(f.fd, job.data.data(), job.data.size());
+            else if (job.kind == Placing && ok)
+                ok = pwrite_all(f.fd, job.data.data(), job.data.size(),
+                    job.offset);
+            else if (job.kind == Closing) {
+                struct stat st;
+                bool regular = fstat(f.fd, &st) == 0 && S_ISREG(st.st_mode);
+                ok = (close(f.fd) == 0) && ok;
+                if (!ok && regular)
+                    unlink(f.name.c_str());
+            }
+            lock.lock();
+            f.failed = !ok;
+            f.closed = job.kind == Closing;
+            queued -= job.data.size();
+            if (job.data.capacity() <= spare_size && spare.size() < 4)
+                spare.push_back(std::move(job.data));
+            changed.notify_all();
+        }
+    }
+
+    void push(size_t File, Kind Type, std::uint64_t Offset,
+        std::vector<unsigned char>&& Data)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        // An empty queue takes any buffer so that large ones get through.
+        changed.wait(lock, [&]() {
+            return queued == 0 || queued + Data.size() <= limit; });
+        queued += Data.size();
+        jobs.push_back(Job { File, Type, Offset, std::move(Data) });
+        changed.notify_all();
+    }
+
+public:
+    WriteBehind(size_t Limit = size_t(64) << 20)
+        : first(0), queued(0), limit(Limit), stop(false),
+        worker(&WriteBehind::run, this) { }
+
+    // Writes everything still in the queue.
+    ~WriteBehind() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+
+    WriteBehind(const WriteBehind&) = delete;
+    WriteBehind& operator=(const WriteBehind&) = delete;
+
+    // Takes ownership of fd. It is closed by the job queued with Close.
+    size_t Open(int fd, const std::string& Name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        files.push_back(File { fd, Name, false, false });
+        return first + files.size() - 1;
+    }
+
+    void Write(size_t File, std::vector<unsigned char>&& Data) {
+        push(File, Appending, 0, std::move(Data));
+    }
+
+    void WriteAt(size_t File, std::uint64_t Offset,
+        std::vector<unsigned char>&& Data)
+    {
+        push(File, Placing, Offset, std::move(Data));
+    }
+
+    void Close(size_t File) {
+        push(File, Closing, 0, std::vector<unsigned char>());
+    }
+
+    // Returns a written buffer for reuse, or an empty one.
+    std::vector<unsigned char> Buffer() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<unsigned char> b;
+        if (!spare.empty()) {
+            b.swap(spare.back());
+            spare.pop_back();
+        }
+        return b;
+    }
+
+    // Waits until files with Name are closed, before it is opened again.
+    void Wait(const std::string& Name) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() {
+            for (auto& f : files)
+                if (!f.closed && f.name == Name)
+                    return false;
+            return true;
+        });
+    }
+
+    // Gets the name and result of the oldest file not yet got, if it has
+    // been closed. Wait waits for it. Returns false if there is none.
+    bool Closed(std::string& Name, bool& Ok, bool Wait) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (Wait)
+            changed.wait(lock, [this]() {
+                return files.empty() || files.front().closed; });
+        if (files.empty() || !files.front().closed)
+            return false;
+        Name.swap(files.front().name);
+        Ok = !files.front().failed;
+        files.pop_front();
+        ++first;
+        return true;
+    }
+};
+
+// Collects small writes to a buffer. Large writes go directly to the file.
+// With a queue, the writes are passed to it instead.
+class FileSink : public ByteSink {
+private:
+    int fd;
+    WriteBehind* queue;
+    size_t file, size;
+    std::vector<unsigned char> buffer;
+    size_t used;
+
+public:
+    FileSink(int FileDescriptor, size_t BufferSize = size_t(1) << 20)
+        : fd(FileDescriptor), queue(nullptr), file(0), size(BufferSize),
+        buffer(BufferSize), used(0) { }
+
+    FileSink(WriteBehind& Queue, size_t File,
+        size_t BufferSize = size_t(1) << 20)
+        : fd(-1), queue(&Queue), file(File), size(BufferSize),
+        buffer(BufferSize), used(0) { }
+
+    bool Write(const unsigned char* Data, size_t Length) {
+        if (used + Length <= buffer.size()) {
+            memcpy(&buffer[used], Data, Length);
+            used += Length;
+            return true;
+        }
+        if (!Flush())
+            return false;
+        if (buffer.size() <= Length) {
+            if (queue == nullptr)
+                return write_all(fd, Data, Length);
+            queue->Write(file, std::vector<unsigned char>(Data, Data + Length));
+            return true;
+        }
+        memcpy(&buffer[0], Data, Length);
+        used = Length;
+        return true;
+    }
+
+    bool WriteAt(std::uint64_t Offset, const unsigned char* Data,
+        size_t Length)
+    {
+        if (!Flush())
+            return false;
+        if (queue == nullptr)
+            return pwrite_all(fd, Data, Length, Offset);
+        queue->WriteAt(file, Offset,
+            std::vector<unsigned char>(Data, Data + Length));
+        return true;
+    }
+
+    bool Flush() {
+        if (queue == nullptr) {
+            bool ok = write_all(fd, &buffer[0], used);
+            used = 0;
+            return ok;
+        }
+        if (used) {
+            buffer.resize(used);
+            queue->Write(file, std::move(buffer));
+            buffer = queue->Buffer();
+            buffer.resize(size);
+            used = 0;
+        }
+        return true;
+    }
+};
+
+// Output file of known size that threads fill in place. Space is reserved
+// first so that running out of it is an error when opening instead of a
+// fault while writing.
+class MappedFile {
+private:
+    int fd;
+    unsigned char* base;
+    size_t size;
+    std::string name;
+
+    bool release() {
+        bool ok = true;
+        if (base != nullptr && munmap(base, size) != 0)
+            ok = false;
+        if (0 <= fd && close(fd) != 0)
+            ok = false;
+        base = nullptr;
+        fd = -1;
+        size = 0;
+        return ok;
+    }
+
+public:
+    MappedFile() : fd(-1), base(nullptr), size(0) { }
+    ~MappedFile() { Close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Returns false if Filename is not a regular file that could be created
+    // with Size bytes and mapped.
+    bool Open(const char* Filename, size_t Size) {
+        fd = open(Filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+            return false;
+        if (Size == 0 ||
+            posix_fallocate(fd, 0, static_cast<off_t>(Size)) != 0)
+        {
+            release();
+            return false;
+        }
+        void* m = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+        if (m == MAP_FAILED) {
+            release();
+            return false;
+        }
+        base = static_cast<unsigned char*>(m);
+        size = Size;
+        name = Filename;
+        return true;
+    }
+
+    unsigned char* Data() { return base; }
+
+    // Unmaps and closes the file. Space was reserved when opening, so the
+    // pages are left for the kernel to write. Returns false on error, after
+    // removing the file.
+    bool Close() {
+        bool ok = release();
+        if (!ok && !name.empty())
+            unlink(name.c_str());
+        name.clear();
+        return ok;
+    }
+};
+
+#endif
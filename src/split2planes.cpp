@@ -12,6 +12,16 @@
 #include "doctest/doctest.h"
 #else
 #include "convenience.hpp"
+#include "streaming.hpp"
+#include "parallel.hpp"
+#include "jsonwriter.hpp"
+#endif
+#if defined(BENCHMARK)
+#include <chrono>
+#include <random>
+#endif
+#if defined(__SSE__)
+#include <xmmintrin.h>
 #endif
 #include <iostream>
 #include <fcntl.h>
@@ -23,6 +33,7 @@
 #include <cstdint>
 #include <sstream>
 #include <deque>
+#include <algorithm>
 
 static size_t plane_count(io::Split2PlanesIn::planesType& Planes) {
     size_t count = 0;
@@ -37,6 +48,9 @@ static size_t plane_count(io::Split2PlanesIn::planesType& Planes) {
     return count;
 }
 
+#if defined(UNITTEST) || defined(BENCHMARK)
+// Previous way of splitting, one pass over the input per plane. Reference
+// for separate_all.
 static void separate(std::vector<std::vector<float>>& Out,
     io::Split2PlanesIn::planesType& Planes, size_t Index)
 {
@@ -49,10 +63,155 @@ static void separate(std::vector<std::vector<float>>& Out,
             row[k] = src[k][Index];
     }
 }
+#endif
+
+// Components in a block of planes filled together.
+static const size_t plane_block = 4;
+
+// Copies components [First, First + Count) of pixels Src[Begin, End) to Dst.
+static void separate_block(float* const* Dst,
+    const std::vector<std::vector<float>>& Src, size_t First, size_t Count,
+    size_t Begin, size_t End)
+{
+    size_t x = Begin;
+#if defined(__SSE__)
+    // Four pixels are transposed at a time. Three components are loaded as
+    // two and one so that nothing past the pixel is read.
+    if (Count == 4)
+        for (; x + 4 <= End; x += 4) {
+            __m128 a = _mm_loadu_ps(Src[x].data() + First);
+            __m128 b = _mm_loadu_ps(Src[x + 1].data() + First);
+            __m128 c = _mm_loadu_ps(Src[x + 2].data() + First);
+            __m128 d = _mm_loadu_ps(Src[x + 3].data() + First);
+            _MM_TRANSPOSE4_PS(a, b, c, d);
+            _mm_storeu_ps(Dst[0] + x, a);
+            _mm_storeu_ps(Dst[1] + x, b);
+            _mm_storeu_ps(Dst[2] + x, c);
+            _mm_storeu_ps(Dst[3] + x, d);
+        }
+    else if (Count == 3) {
+        auto load3 = [First](const std::vector<float>& Pixel) {
+            const float* p = Pixel.data() + First;
+            return _mm_movelh_ps(
+                _mm_loadl_pi(_mm_setzero_ps(),
+                    reinterpret_cast<const __m64*>(p)),
+                _mm_load_ss(p + 2));
+        };
+        for (; x + 4 <= End; x += 4) {
+            __m128 a = load3(Src[x]);
+            __m128 b = load3(Src[x + 1]);
+            __m128 c = load3(Src[x + 2]);
+            __m128 d = load3(Src[x + 3]);
+            _MM_TRANSPOSE4_PS(a, b, c, d);
+            _mm_storeu_ps(Dst[0] + x, a);
+            _mm_storeu_ps(Dst[1] + x, b);
+            _mm_storeu_ps(Dst[2] + x, c);
+        }
+    }
+#endif
+    if (Count == 1) {
+        for (; x < End; ++x)
+            Dst[0][x] = Src[x][First];
+        return;
+    }
+    for (; x < End; ++x) {
+        const float* p = Src[x].data() + First;
+        for (size_t k = 0; k < Count; ++k)
+            Dst[k][x] = p[k];
+    }
+}
+
+// Splits all Count planes in one pass over the rows, to rows starting from
+// First in Out. Pixels of a row are taken in blocks and each block is split
+// a few planes at a time, so the pixels and the output rows being filled
+// stay in cache.
+static void separate_all(std::vector<std::vector<std::vector<float>>>& Out,
+    io::Split2PlanesIn::planesType& Planes, size_t Count, size_t First = 0)
+{
+    const size_t pixel_block = 1024;
+    Out.resize(Count);
+    for (auto& plane : Out)
+        plane.resize(First + Planes.size());
+    std::vector<float*> dst(Count);
+    for (size_t r = 0; r < Planes.size(); ++r) {
+        const std::vector<std::vector<float>>& src = Planes[r];
+        for (size_t k = 0; k < Count; ++k) {
+            Out[k][First + r].resize(src.size());
+            dst[k] = Out[k][First + r].data();
+        }
+        for (size_t x = 0; x < src.size(); x += pixel_block) {
+            size_t end = std::min(src.size(), x + pixel_block);
+            for (size_t k = 0; k < Count; k += plane_block)
+                separate_block(&dst[k], src, k,
+                    std::min(plane_block, Count - k), x, end);
+        }
+    }
+}
+
+#if defined(BENCHMARK)
+
+template<typename Func>
+static double best_seconds(Func F) {
+    double best = 0.0;
+    for (int k = 0; k < 5; ++k) {
+        auto start = std::chrono::steady_clock::now();
+        F();
+        std::chrono::duration<double> d =
+            std::chrono::steady_clock::now() - start;
+        if (k == 0 || d.count() < best)
+            best = d.count();
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    const size_t width = 2048, height = 2048;
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+    for (size_t count : { 1, 3, 4, 8 }) {
+        io::Split2PlanesIn::planesType planes(height,
+            std::vector<std::vector<float>>(width, std::vector<float>(count)));
+        for (auto& row : planes)
+            for (auto& pixel : row)
+                for (auto& v : pixel)
+                    v = dist(gen);
+        std::vector<std::vector<std::vector<float>>> out;
+        std::vector<std::vector<float>> plane;
+        auto report = [&](const char* Name, double Seconds) {
+            std::cout << count << " planes " << Name << ' '
+                << (width * height / Seconds) * 1e-6 << " Mpixels/s\n";
+        };
+        report("separate per plane", best_seconds([&]() {
+            for (size_t k = 0; k < count; ++k)
+                separate(plane, planes, k);
+        }));
+        report("separate_all", best_seconds([&]() {
+            separate_all(out, planes, plane_count(planes));
+        }));
+    }
+    return 0;
+}
 
-#if !defined(UNITTEST)
+#elif !defined(UNITTEST)
 
-static int split2planes(io::Split2PlanesIn& Val) {
+static int write_planes(
+    const std::vector<std::vector<std::vector<float>>>& Planes,
+    ThreadPool& Pool)
+{
+    std::vector<std::string> names;
+    for (size_t k = 0; k < Planes.size(); ++k)
+        names.push_back("plane" + std::to_string(k));
+    if (!write_arrays(1, names, Planes, Pool, [](std::ostream& S,
+        const std::vector<float>& Row, std::vector<char>& B)
+        { io::Write(S, Row, B); }))
+    {
+        std::cerr << "Error writing output." << std::endl;
+        return 2;
+    }
+    return 0;
+}
+
+static int split2planes(io::Split2PlanesIn& Val, ThreadPool& Pool) {
     size_t count = 0;
     try {
         count = plane_count(Val.planes());
@@ -61,33 +220,66 @@ static int split2planes(io::Split2PlanesIn& Val) {
         std::cerr << msg << std::endl;
         return 1;
     }
-    std::cout << '{';
-    std::vector<std::vector<float>> plane;
-    std::vector<char> buffer(256, 0);
-    for (size_t k = 0; k < count; ++k) {
-        separate(plane, Val.planes(), k);
-        std::cout << "\"plane" << k << "\":";
-        io::Write(std::cout, plane, buffer);
-        if (k + 1 < count)
-            std::cout << ',';
-    }
-    std::cout << '}' << std::endl;
-    return 0;
+    std::vector<std::vector<std::vector<float>>> planes;
+    separate_all(planes, Val.planes(), count);
+    return write_planes(planes, Pool);
 }
 
+// Pixels are split to plane rows a batch of input rows at a time, while the
+// parser reads the next batch, so the whole input is never in memory.
+class PlaneSplitter : public StreamingInputParser<io::ParserPool,
+    io::Split2PlanesIn_Parser, io::Split2PlanesIn>::Handler
+{
+private:
+    std::vector<std::vector<std::vector<float>>> planes;
+    size_t rows;
+    ThreadPool pool;
+
+public:
+    PlaneSplitter() : rows(0), pool(0) { }
+
+    bool Begin(io::Split2PlanesIn& Val) {
+        planes.clear();
+        rows = 0;
+        return true;
+    }
+
+    // Parser checks that all pixels have the same number of components.
+    // Rows before the first non-empty one stay empty in all planes.
+    int Append(io::Split2PlanesIn::planesType& Batch) {
+        size_t count = plane_count(Batch);
+        if (count == 0)
+            count = planes.size();
+        separate_all(planes, Batch, count, rows);
+        rows += Batch.size();
+        return 0;
+    }
+
+    int End() {
+        int status = write_planes(planes, pool);
+        planes.clear();
+        return status;
+    }
+
+    int Whole(io::Split2PlanesIn& Val) {
+        return split2planes(Val, pool);
+    }
+};
+
 int main(int argc, char** argv) {
     int f = 0;
     if (argc > 1)
         f = open(argv[1], O_RDONLY);
-    InputParser<io::ParserPool, io::Split2PlanesIn_Parser, io::Split2PlanesIn>
-        ip(f);
-    int status = ip.ReadAndParse(split2planes);
+    StreamingInputParser<io::ParserPool, io::Split2PlanesIn_Parser,
+        io::Split2PlanesIn> ip(f, "planes", false);
+    PlaneSplitter splitter;
+    int status = ip.ReadAndParse(splitter);
     if (f)
         close(f);
     return status;
 }
 
-#else
+#elif defined(UNITTEST)
 
 TEST_CASE("plane_count") {
     SUBCASE("All same") {
@@ -155,4 +347,37 @@ TEST_CASE("separate") {
     }
 }
 
+TEST_CASE("separate_all matches separate") {
+    std::vector<std::vector<std::vector<float>>> all;
+    std::vector<std::vector<float>> out;
+    for (size_t count = 1; count <= 9; ++count) {
+        // Row lengths cover empty rows, partial and full SIMD groups.
+        io::Split2PlanesIn::planesType planes;
+        for (size_t width : { 0, 1, 3, 4, 7, 1030 }) {
+            planes.push_back(std::vector<std::vector<float>>());
+            for (size_t x = 0; x < width; ++x) {
+                planes.back().push_back(std::vector<float>());
+                for (size_t k = 0; k < count; ++k)
+                    planes.back().back().push_back(float(x * 16 + k));
+            }
+        }
+        separate_all(all, planes, count);
+        REQUIRE(all.size() == count);
+        for (size_t k = 0; k < count; ++k) {
+            separate(out, planes, k);
+            REQUIRE(all[k] == out);
+        }
+        // Split in two parts as streamed batches are.
+        io::Split2PlanesIn::planesType head(planes.begin(), planes.begin() + 2);
+        io::Split2PlanesIn::planesType tail(planes.begin() + 2, planes.end());
+        all.clear();
+        separate_all(all, head, count);
+        separate_all(all, tail, count, head.size());
+        for (size_t k = 0; k < count; ++k) {
+            separate(out, planes, k);
+            REQUIRE(all[k] == out);
+        }
+    }
+}
+
 #endif
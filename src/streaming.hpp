@@ -0,0 +1,334 @@
+//
+//  streaming.hpp
+//
+//  Created by Ismo Kärkkäinen on 18.10.2026.
+//  Copyright © 2026 Ismo Kärkkäinen. All rights reserved.
+//
+// Licensed under Universal Permissive License. See License.txt.
+
+// Input parser that hands rows of an image array to a handler while the
+// input is still being read, so the whole array is never in memory.
+
+#if !defined(STREAMING_HPP)
+#define STREAMING_HPP
+
+#include <vector>
+#include <string>
+#include <future>
+#include <exception>
+#include <charconv>
+#include <system_error>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <iostream>
+
+
+// Reads objects like InputParser. Members before Key are parsed first with
+// Key given as [[[0]]] and if the handler accepts, the rows in Key are read
+// one at a time and passed on in batches. Otherwise the generated parser
+// parses the whole object. Key must be the last member when streaming. Rows
+// must have equal width unless EqualWidth is false.
+template<typename Pool, typename Parser, typename Result>
+class StreamingInputParser {
+public:
+    typedef std::vector<std::vector<std::vector<float>>> Rows;
+
+    class Handler {
+    public:
+        virtual ~Handler() { }
+        // Returns true to receive the rows of Key via Append and End.
+        virtual bool Begin(Result& Val) = 0;
+        // Gets next rows, in a thread other than the parser.
+        virtual int Append(Rows& Batch) = 0;
+        // Called after the last row.
+        virtual int End() = 0;
+        // Gets the whole object if Begin returned false.
+        virtual int Whole(Result& Val) = 0;
+    };
+
+private:
+    bool eof, equal_width;
+    int fd;
+    const size_t block_size = 65536;
+    // Values in a batch of rows, at least one row.
+    const size_t batch_values = size_t(1) << 18;
+    std::string buffer;
+    size_t pos;
+    std::string key;
+    Pool pp;
+    Parser parser;
+
+    static bool is_space(char C) {
+        return C == ' ' || C == '\n' || C == '\r' || C == '\t';
+    }
+
+    // Drops input before pos and appends a block. False at end of input.
+    bool more() {
+        buffer.erase(0, pos);
+        pos = 0;
+        while (!eof) {
+            size_t size = buffer.size();
+            buffer.resize(size + block_size);
+            errno = 0;
+            int count = read(fd, &buffer[size], block_size);
+            buffer.resize(size + ((count < 0) ? 0 : count));
+            if (0 < count)
+                return true;
+            eof = (count == 0) ||
+                (count < 0 && !(errno == EAGAIN || errno == EINTR));
+        }
+        return false;
+    }
+
+    // Skips whitespace. Returns next character or -1 at end of input.
+    int next() {
+        while (true) {
+            while (pos < buffer.size() && is_space(buffer[pos]))
+                ++pos;
+            if (pos < buffer.size())
+                return buffer[pos];
+            if (!more())
+                return -1;
+        }
+    }
+
+    // Length of the string, number, array or object at pos.
+    bool value_length(size_t& Length) {
+        int depth = 0;
+        bool string = false, escape = false;
+        for (size_t k = 0; ; ++k) {
+            if (pos + k == buffer.size() && !more())
+                return false;
+            char c = buffer[pos + k];
+            if (string) {
+                if (escape)
+                    escape = false;
+                else if (c == '\\')
+                    escape = true;
+                else if (c == '"') {
+                    string = false;
+                    if (depth == 0) {
+                        Length = k + 1;
+                        return true;
+                    }
+                }
+            } else if (c == '"')
+                string = true;
+            else if (c == '[' || c == '{')
+                ++depth;
+            else if (c == ']' || c == '}') {
+                if (depth == 0) {
+                    Length = k;
+                    return true;
+                }
+                if (--depth == 0) {
+                    Length = k + 1;
+                    return true;
+                }
+            } else if (depth == 0 && (c == ',' || c == ':' || is_space(c))) {
+                Length = k;
+                return true;
+            }
+        }
+    }
+
+    // Parses Prefix followed by input as one object with generated parser.
+    int whole(const std::string& Prefix, Handler& H) {
+        try {
+            const char* end = parser.Parse(
+                Prefix.data(), Prefix.data() + Prefix.size(), pp);
+            while (!parser.Finished()) {
+                if (pos == buffer.size() && !more())
+                    return 0;
+                end = parser.Parse(buffer.data() + pos,
+                    buffer.data() + buffer.size(), pp);
+                pos = parser.Finished() ? end - buffer.data() : buffer.size();
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        Result val;
+        parser.Swap(val.values);
+        return H.Whole(val);
+    }
+
+    // Reads the array at pos and passes rows to H in batches. Encoding
+    // of a batch runs while the next one is being parsed.
+    int rows(Handler& H) {
+        Rows batch, current;
+        std::vector<std::vector<float>> row;
+        std::vector<float> pixel;
+        size_t width = 0, components = 0, values = 0;
+        bool first_pixel = true, first_row = true;
+        std::future<int> pending;
+        auto flush = [&]() -> int {
+            int rv = pending.valid() ? pending.get() : 0;
+            current.swap(batch);
+            batch.clear();
+            values = 0;
+            if (rv == 0 && !current.empty())
+                pending = std::async(std::launch::async,
+                    [&H, &current]() { return H.Append(current); });
+            return rv;
+        };
+        auto fail = [&](const std::string& Message) {
+            if (!Message.empty())
+                std::cerr << Message << std::endl;
+            if (pending.valid())
+                pending.get();
+            return 1;
+        };
+        enum { Open, Comma, Value } state = Open;
+        ++pos;
+        for (int depth = 1; 0 < depth;) {
+            int c = next();
+            if (c == -1)
+                return fail("Unexpected end of input.");
+            if (c == '[' && state != Value && depth < 3) {
+                ++depth;
+                state = Open;
+                ++pos;
+            } else if (c == ']' && state != Comma) {
+                if (depth == 3) {
+                    if (first_pixel)
+                        components = pixel.size();
+                    first_pixel = false;
+                    if (pixel.size() != components) {
+                        std::cerr << "Color component count not constant, " <<
+                            pixel.size() << " != " << components << "\n";
+                        return fail(std::string());
+                    }
+                    row.push_back(std::move(pixel));
+                    pixel = std::vector<float>();
+                    pixel.reserve(components);
+                } else if (depth == 2) {
+                    if (first_row)
+                        width = row.size();
+                    first_row = false;
+                    if (equal_width && row.size() != width) {
+                        std::cerr << "Row width not constant, " <<
+                            row.size() << " != " << width << "\n";
+                        return fail(std::string());
+                    }
+                    values += row.size() * components + 1;
+                    batch.push_back(std::move(row));
+                    row = std::vector<std::vector<float>>();
+                    row.reserve(width);
+                    if (batch_values <= values) {
+                        int rv = flush();
+                        if (rv)
+                            return rv;
+                    }
+                }
+                --depth;
+                state = Value;
+                ++pos;
+            } else if (c == ',' && state == Value) {
+                state = Comma;
+                ++pos;
+            } else if (depth == 3 && state != Value) {
+                size_t k = 0;
+                while (pos + k < buffer.size() || more()) {
+                    char d = buffer[pos + k];
+                    if (!(('0' <= d && d <= '9') || d == '-' || d == '+' ||
+                        d == '.' || d == 'e' || d == 'E'))
+                            break;
+                    ++k;
+                }
+                float f = 0.0f;
+                auto result = std::from_chars(
+                    buffer.data() + pos, buffer.data() + pos + k, f);
+                if (k == 0 || result.ec != std::errc() ||
+                    result.ptr != buffer.data() + pos + k)
+                        return fail("Invalid number in " + key + ".");
+                pixel.push_back(f);
+                state = Value;
+                pos += k;
+            } else
+                return fail("Invalid array in " + key + ".");
+        }
+        int rv = flush();
+        return rv ? rv : flush();
+    }
+
+    // Reads one object. Returns -1 at end of input.
+    int object(Handler& H) {
+        int c = next();
+        if (c == -1)
+            return -1;
+        std::string members(1, static_cast<char>(c));
+        ++pos;
+        if (c != '{')
+            return whole(members, H);
+        size_t length = 0;
+        while ((c = next()) == '"' || c == ',' || c == ':') {
+            if (c != '"' || !value_length(length))
+                length = 1;
+            std::string item(buffer, pos, length);
+            if (item == '"' + key + '"')
+                break;
+            members += item;
+            pos += length;
+            if (c != ':')
+                continue;
+            if (next() == -1 || !value_length(length))
+                return whole(members, H);
+            members.append(buffer, pos, length);
+            pos += length;
+        }
+        if (c != '"')
+            return whole(members, H);
+        Result val;
+        try {
+            std::string probe = members + '"' + key + "\":[[[0]]]}";
+            Parser p;
+            p.Parse(probe.data(), probe.data() + probe.size(), pp);
+            if (!p.Finished())
+                return whole(members, H);
+            p.Swap(val.values);
+        }
+        catch (const std::exception& e) {
+            // Generated parser reports the error when parsing all.
+            return whole(members, H);
+        }
+        if (!H.Begin(val))
+            return whole(members, H);
+        pos += length;
+        if (next() != ':') {
+            std::cerr << "Expected : after " << key << std::endl;
+            return 1;
+        }
+        ++pos;
+        if (next() != '[') {
+            std::cerr << "Expected array in " << key << std::endl;
+            return 1;
+        }
+        int rv = rows(H);
+        if (rv == 0 && next() != '}') {
+            std::cerr << "Members after " << key <<
+                " are not supported when streaming." << std::endl;
+            rv = 1;
+        }
+        ++pos;
+        return (rv == 0) ? H.End() : rv;
+    }
+
+public:
+    StreamingInputParser(int FileDescriptor, const char* Key,
+        bool EqualWidth = true)
+        : eof(false), equal_width(EqualWidth), fd(FileDescriptor), pos(0),
+        key(Key) { }
+
+    int ReadAndParse(Handler& H) {
+        while (true) {
+            int rv = object(H);
+            if (rv)
+                return (rv < 0) ? 0 : rv;
+        }
+    }
+};
+
+#endif
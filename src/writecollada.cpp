@@ -13,32 +13,34 @@
 #else
 #include "convenience.hpp"
 #endif
+#include "mesh.hpp"
+#include "parallel.hpp"
 #include <iostream>
 #include <fcntl.h>
 #include <unistd.h>
 #include <vector>
-#include <cmath>
 #include <fstream>
 #include <cstddef>
 #include <cstdint>
-#include <sstream>
-#include <deque>
 
 
 #if !defined(UNITTEST)
 static int writecollada(io::WriteColladaIn& Val) {
     if (Val.filename().substr(Val.filename().size() - 4) != ".dae")
         Val.filename() += ".dae";
-    // Convert all tri-strips (and later fans) to triangles.
-    std::vector<std::vector<std::uint32_t>> triangles;
-    for (auto& strip : Val.tristrips())
-        for (size_t k = 0; k < strip.size() - 2; ++k)
-            if (k & 1)
-                triangles.push_back(std::vector<std::uint32_t> {
-                    strip[k], strip[k + 2], strip[k + 1] });
-            else
-                triangles.push_back(std::vector<std::uint32_t> {
-                    strip[k], strip[k + 1], strip[k + 2] });
+    bool strips = false;
+    if (Val.primitivesGiven() && !primitives_option(strips, Val.primitives()))
+        return 1;
+    ThreadPool pool(0);
+    Mesh mesh;
+    if (!mesh_attribute(mesh.positions, Val.vertices(), 3, pool)) {
+        std::cerr << "Vertices must be arrays of 3 values." << std::endl;
+        return 1;
+    }
+    // Each strip is in its own element either way, so strips are never
+    // larger than triangles and are output as they are.
+    if (!strips)
+        mesh_triangles(mesh, Val.tristrips(), pool);
     std::ofstream out(Val.filename().c_str());
     if (out.fail()) {
         std::cerr << "Failed to open: " << Val.filename() << std::endl;
@@ -69,23 +71,42 @@ static int writecollada(io::WriteColladaIn& Val) {
     out << R"WRDAE(<library_geometries><geometry id="content-lib"><mesh>)WRDAE";
     // Vertices.
     out << R"WRDAE(<source id="content-positions"><float_array id="content-positions-array" count=")WRDAE"
-        << Val.vertices().size() * 3 << "\">\n";
-    for (auto& vertex : Val.vertices())
-        out << vertex[0] << ' ' << vertex[1] << ' ' << vertex[2] << "\n";
+        << mesh.positions.values.size() << "\">\n";
+    const std::vector<float>& v(mesh.positions.values);
+    for (size_t k = 0; k < v.size(); k += 3)
+        out << v[k] << ' ' << v[k + 1] << ' ' << v[k + 2] << "\n";
     out << "</float_array><technique_common><accessor count=\""
-        << Val.vertices().size()
+        << mesh.positions.Count()
         << R"WRDAE(" source="#content-positions-array" stride="3">
 <param name="X" type="float"/><param name="Y" type="float"/><param name="Z" type="float"/>
 </accessor></technique_common></source>)WRDAE";
     out << R"WRDAE(
-<vertices id="content-vertices"><input semantic="POSITION" source="#content-positions"/></vertices>
-<triangles material="material" count=")WRDAE"
-        << triangles.size()
+<vertices id="content-vertices"><input semantic="POSITION" source="#content-positions"/></vertices>)WRDAE";
+    const char* element = strips ? "tristrips" : "triangles";
+    size_t count = mesh.indices.size() / 3;
+    if (strips) {
+        count = 0;
+        for (auto& strip : Val.tristrips())
+            count += (3 <= strip.size()) ? 1 : 0;
+    }
+    out << "\n<" << element << R"WRDAE( material="material" count=")WRDAE"
+        << count
         << R"WRDAE(">
 <input offset="0" semantic="VERTEX" source="#content-vertices" set="0"/>)WRDAE";
-    for (auto& tri : triangles)
-        out << "<p>" << tri[0] << ' ' << tri[1] << ' ' << tri[2] << "</p>\n";
-    out << R"WRDAE(</triangles></mesh></geometry></library_geometries>
+    if (strips)
+        for (auto& strip : Val.tristrips()) {
+            if (strip.size() < 3)
+                continue;
+            out << "<p>" << strip.front();
+            for (size_t k = 1; k < strip.size(); ++k)
+                out << ' ' << strip[k];
+            out << "</p>\n";
+        }
+    const std::vector<std::uint32_t>& t(mesh.indices);
+    for (size_t k = 0; k < t.size(); k += 3)
+        out << "<p>" << t[k] << ' ' << t[k + 1] << ' ' << t[k + 2] << "</p>\n";
+    out << "</" << element << ">";
+    out << R"WRDAE(</mesh></geometry></library_geometries>
 <library_visual_scenes><visual_scene id="scene">
 <node id="content">
   <instance_geometry url="#content-lib"><bind_material><technique_common>
@@ -17,113 +17,127 @@
 #error Texture requires PNG support.
 #endif
 #include "memimage.hpp"
+#include "parallel.hpp"
+#include "sink.hpp"
+#include "digest.hpp"
+#include "mesh.hpp"
 #include <iostream>
 #include <fcntl.h>
 #include <unistd.h>
 #include <vector>
 #include <cmath>
-#include <fstream>
 #include <cstddef>
 #include <cstdint>
-#include <strstream>
+#include <cstring>
+#include <limits>
+#include <sstream>
 #include <deque>
+#include <algorithm>
 
 
-template<typename T>
-class Buffer : public std::vector<T> {
-public:
-    Buffer& operator<<(T c) {
-        this->push_back(c);
-        return *this;
-    }
-
-    Buffer& operator<<(int c) {
-        this->push_back(static_cast<T>(c));
-        return *this;
-    }
-
-    Buffer& operator<<(const T* c) {
-        while (*c)
-            this->push_back(*c++);
-        return *this;
-    }
+static void put_u32(unsigned char* Dst, std::uint32_t Value) {
+    Dst[0] = Value & 0xff;
+    Dst[1] = (Value >> 8) & 0xff;
+    Dst[2] = (Value >> 16) & 0xff;
+    Dst[3] = (Value >> 24) & 0xff;
+}
 
-    Buffer& write_u32(std::uint32_t s) {
-        this->push_back(s & 0xff);
-        this->push_back((s >> 8) & 0xff);
-        this->push_back((s >> 16) & 0xff);
-        this->push_back((s >> 24) & 0xff);
-        return *this;
-    }
+static std::uint64_t row_digest(const std::vector<float>& Row,
+    std::uint64_t Seed)
+{
+    return digest(Row.data(), Row.size() * sizeof(float), Seed);
+}
 
-    Buffer& write_u32(std::uint32_t s, size_t index) {
-        (*this)[index] = s & 0xff;
-        (*this)[++index] = (s >> 8) & 0xff;
-        (*this)[++index] = (s >> 16) & 0xff;
-        (*this)[++index] = (s >> 24) & 0xff;
-        return *this;
-    }
-};
+static std::uint64_t row_digest(const std::vector<std::uint32_t>& Row,
+    std::uint64_t Seed)
+{
+    return digest(Row.data(), Row.size() * sizeof(std::uint32_t), Seed);
+}
 
-static size_t flatten(std::vector<float>& Out,
-    std::vector<float>& Min, std::vector<float>& Max,
-    const std::vector<std::vector<float>>& Src)
+static std::uint64_t row_digest(const std::vector<std::vector<float>>& Row,
+    std::uint64_t Seed)
 {
-    Out.resize(0);
-    Out.reserve(Src.size() * Src.front().size());
-    Min.resize(Src.front().size());
-    Max.resize(Src.front().size());
-    for (size_t k = 0; k < Src.front().size(); ++k)
-        Min[k] = Max[k] = Src.front()[k];
-    for (auto& vertex : Src)
-        for (size_t k = 0; k < Src.front().size(); ++k) {
-            Out.push_back(vertex[k]);
-            if (Max[k] < vertex[k])
-                Max[k] = vertex[k];
-            else if (vertex[k] < Min[k])
-                Min[k] = vertex[k];
-        }
-    return Out.size() * sizeof(float);
+    for (auto& pixel : Row)
+        Seed = row_digest(pixel, Seed);
+    return Seed;
+}
+
+// Digest of Src. Blocks of rows are hashed in parallel and combined in order
+// so that the result does not depend on thread count.
+template<typename Rows>
+static std::uint64_t rows_digest(const Rows& Src, ThreadPool& Pool) {
+    const size_t block = 4096;
+    std::vector<std::uint64_t> digests((Src.size() + block - 1) / block + 1);
+    digests.back() = Src.size();
+    Pool.Ranges(digests.size() - 1, 1,
+        [&](size_t Part, size_t Begin, size_t End) {
+            for (size_t b = Begin; b < End; ++b) {
+                std::uint64_t h = 0;
+                size_t last = std::min(Src.size(), (b + 1) * block);
+                for (size_t r = b * block; r < last; ++r)
+                    h = row_digest(Src[r], h);
+                digests[b] = h;
+            }
+        });
+    return digest(digests.data(), digests.size() * sizeof(std::uint64_t));
 }
 
 #if !defined(UNITTEST)
 static int writeglb(io::WriteGLBIn& Val) {
     if (Val.filename().substr(Val.filename().size() - 4) != ".glb")
         Val.filename() += ".glb";
-    Buffer<char> header, json_chunk, bin;
-    header.write_u32(0x46546C67).write_u32(2);
-    json_chunk.write_u32(0).write_u32(0x4E4F534A);
-    std::strstream json;
-    bin.write_u32(0).write_u32(0x004E4942);
+    ThreadPool pool(0);
+    bool skip = false;
+    if (Val.unchangedGiven()) {
+        if (strcasecmp(Val.unchanged().c_str(), "skip") == 0)
+            skip = true;
+        else if (strcasecmp(Val.unchanged().c_str(), "write") != 0) {
+            std::cerr << "Unsupported action for unchanged output: "
+                << Val.unchanged() << std::endl;
+            return 1;
+        }
+    }
+    bool strips = false;
+    if (Val.primitivesGiven() && !primitives_option(strips, Val.primitives()))
+        return 1;
+    // Output depends only on the inputs, so they are hashed as they are.
+    std::uint64_t value = 0;
+    if (skip) {
+        std::uint64_t parts[5] = {
+            rows_digest(Val.vertices(), pool),
+            Val.coordinatesGiven() ? rows_digest(Val.coordinates(), pool) : 0,
+            Val.textureGiven() ? rows_digest(Val.texture(), pool) : 1,
+            rows_digest(Val.tristrips(), pool), strips ? 1U : 0U };
+        value = digest(parts, sizeof(parts));
+        if (digest_matches(Val.filename(), value))
+            return 0;
+    }
+    forget_digest(Val.filename());
+    Mesh mesh;
+    if (!mesh_attribute(mesh.positions, Val.vertices(), 3, pool)) {
+        std::cerr << "Vertices must be arrays of 3 values." << std::endl;
+        return 1;
+    }
+    if (Val.coordinatesGiven() &&
+        !mesh_attribute(mesh.coordinates, Val.coordinates(), 2, pool))
+    {
+        std::cerr << "Coordinates must be arrays of 2 values." << std::endl;
+        return 1;
+    }
+    if (!strips || !mesh_strip(mesh, Val.tristrips(), pool))
+        mesh_triangles(mesh, Val.tristrips(), pool);
+    size_t index_len = mesh.IndexBytes();
+    size_t end_of_previous = index_len;
+    size_t vertex_len = mesh.positions.Bytes();
+    std::ostringstream json;
     json << R"GLTF({"scenes":[{"nodes":[0]}],"nodes":[{"mesh":0}],
 "meshes":[{"primitives":[{"attributes":{"POSITION":1)GLTF";
     if (Val.coordinatesGiven())
         json << R"GLTF(,"TEXCOORD_0":2)GLTF";
-    json << R"GLTF(},"indices":0,"mode":4)GLTF";
+    json << R"GLTF(},"indices":0,"mode":)GLTF" << (mesh.strip ? 5 : 4);
     if (Val.textureGiven())
         json << R"GLTF(,"material":0)GLTF";
     json << R"GLTF(})GLTF";
-    // Convert all tri-strips (and later fans) to triangles.
-    std::vector<std::uint32_t> tris;
-    for (auto& strip : Val.tristrips())
-        for (size_t k = 0; k < strip.size() - 2; ++k) {
-            tris.push_back(strip[k]);
-            if (k & 1) {
-                tris.push_back(strip[k + 2]);
-                tris.push_back(strip[k + 1]);
-            } else {
-                tris.push_back(strip[k + 1]);
-                tris.push_back(strip[k + 2]);
-            }
-        }
-    for (auto& idx : tris)
-        bin.write_u32(idx);
-    size_t index_len = bin.size() - 8;
-    size_t end_of_previous = index_len;
-    std::vector<float> flat, vertex_max, vertex_min;
-    size_t vertex_len = flatten(flat, vertex_min, vertex_max, Val.vertices());
-    for (auto& v : flat)
-        bin.write_u32(*reinterpret_cast<std::uint32_t*>(&v));
     json << R"GLTF(]}],
 "bufferViews":[{"buffer":0,"byteOffset":0,"byteLength":)GLTF"
         << index_len << R"GLTF(,"target":34963},
@@ -131,87 +145,112 @@ static int writeglb(io::WriteGLBIn& Val) {
         << end_of_previous << R"GLTF(,"byteLength":)GLTF"
         << vertex_len << R"GLTF(,"target":34962})GLTF";
     end_of_previous += vertex_len;
-    size_t coordinates_len = 0;
-    std::vector<float> coordinates_max, coordinates_min;
+    size_t coordinates_len = mesh.coordinates.Bytes();
     if (Val.coordinatesGiven()) {
-        coordinates_len = flatten(flat,
-            coordinates_min, coordinates_max, Val.coordinates());
-        for (auto& v : flat)
-            bin.write_u32(*reinterpret_cast<std::uint32_t*>(&v));
         json << R"GLTF(,
 {"buffer":0,"byteOffset":)GLTF"
             << end_of_previous << R"GLTF(,"byteLength":)GLTF"
             << coordinates_len << R"GLTF(,"target":34962})GLTF";
     }
-    size_t image_len = 0;
+    std::vector<unsigned char> img;
     int image_max = 0;
     if (Val.textureGiven()) {
-        std::vector<unsigned char> img = memoryPNG(Val.texture(), 8);
-        image_len = img.size();
-        for (auto& b : img) {
+        img = memoryPNG(Val.texture(), 8);
+        for (auto& b : img)
             if (image_max < b)
                 image_max = b;
-            bin << static_cast<char>(b);
-        }
         json << R"GLTF(,
 {"buffer":0,"byteOffset":)GLTF"
             << end_of_previous + coordinates_len << R"GLTF(,"byteLength":)GLTF"
-            << image_len << R"GLTF(})GLTF";
+            << img.size() << R"GLTF(})GLTF";
     }
     json << R"GLTF(],
 "accessors":[{"bufferView":0,"byteOffset":0,"componentType":5125,"count":)GLTF"
-        << (index_len / sizeof(std::uint32_t))
-        << R"GLTF(,"type":"SCALAR","max":[)GLTF"
-        << vertex_len / (sizeof(float) * 3) - 1
-        << R"GLTF(],"min":[0]},)GLTF" << "\n";
+        << mesh.indices.size()
+        << R"GLTF(,"type":"SCALAR","max":[)GLTF" << mesh.index_maximum
+        << R"GLTF(],"min":[)GLTF" << mesh.index_minimum << "]},\n";
+    const std::vector<float>& vmax(mesh.positions.maximum);
+    const std::vector<float>& vmin(mesh.positions.minimum);
     json << R"GLTF({"bufferView":1,"byteOffset":0,"componentType":5126,"count":)GLTF"
-        << vertex_len / (sizeof(float) * 3)
+        << mesh.positions.Count()
         << R"GLTF(,"type":"VEC3","max":[)GLTF"
-        << vertex_max[0] << ',' << vertex_max[1] << ',' << vertex_max[2]
+        << vmax[0] << ',' << vmax[1] << ',' << vmax[2]
         << R"GLTF(],"min":[)GLTF"
-        << vertex_min[0] << ',' << vertex_min[1] << ',' << vertex_min[2] << "]}";
+        << vmin[0] << ',' << vmin[1] << ',' << vmin[2] << "]}";
     if (Val.coordinatesGiven()) {
+        const std::vector<float>& cmax(mesh.coordinates.maximum);
+        const std::vector<float>& cmin(mesh.coordinates.minimum);
         json << R"GLTF(,{"bufferView":2,"byteOffset":0,"componentType":5126,"count":)GLTF"
-            << coordinates_len / (sizeof(float) * 2)
+            << mesh.coordinates.Count()
             << R"GLTF(,"type":"VEC2","max":[)GLTF"
-            << coordinates_max[0] << ',' << coordinates_max[1]
+            << cmax[0] << ',' << cmax[1]
             << R"GLTF(],"min":[)GLTF"
-            << coordinates_min[0] << ',' << coordinates_min[1] << "]}";
+            << cmin[0] << ',' << cmin[1] << "]}";
         end_of_previous += coordinates_len;
     }
     if (Val.textureGiven())
         json << R"GLTF(,{"bufferView":3,"byteOffset":0,"componentType":5121,"count":)GLTF"
-            << image_len << R"GLTF(,"type":"SCALAR","max":[)GLTF"
+            << img.size() << R"GLTF(,"type":"SCALAR","max":[)GLTF"
             << image_max << R"GLTF(],"min":[0]}],
 "textures":[{"sampler":0,"source":0}],
 "images":[{"bufferView":3,"mimeType":"image/png"}],
 "samplers":[{"magFilter":9729,"minFilter":9729,"wrapS":33071,"wrapT":33071}],
 "materials":[{"pbrMetallicRoughness":{"baseColorTexture":{"index":0},"metallicFactor":0.0}}
 )GLTF";
+    const size_t bin_len = end_of_previous + img.size();
     json << R"GLTF(],"buffers":[{"byteLength":)GLTF"
-        << bin.size() - 8 << R"GLTF(}],"asset":{"version":"2.0"}})GLTF"
-        << std::ends;
-    json_chunk << json.str();
-    json.freeze(false);
-    while (json_chunk.size() & 0x3)
-        json_chunk << ' ';
-    json_chunk.write_u32(json_chunk.size() - 8, 0);
-    while (bin.size() & 0x3)
-        bin << '\0';
-    bin.write_u32(bin.size() - 8, 0);
-    header.write_u32(header.size() + 4 + json_chunk.size() + bin.size());
-    std::ofstream out(Val.filename().c_str(),
-        std::ios_base::out | std::ios_base::binary);
-    if (out.fail()) {
+        << bin_len << R"GLTF(}],"asset":{"version":"2.0"}})GLTF";
+    // Chunks are padded to 4 bytes, JSON with spaces and binary with zeros.
+    // Binary chunk is written from the mesh arrays and the PNG as they are.
+    std::string json_chunk = json.str();
+    json_chunk.resize((json_chunk.size() + 3) & ~size_t(3), ' ');
+    const size_t bin_chunk = (bin_len + 3) & ~size_t(3);
+    // Format limits total length to 32 bits.
+    std::uint64_t total = std::uint64_t(12) + 8 + json_chunk.size() +
+        8 + bin_chunk;
+    if (std::numeric_limits<std::uint32_t>::max() < total) {
+        std::cerr << "Output exceeds GLB size limit: " << total << std::endl;
+        return 1;
+    }
+    unsigned char header[20], bin_header[8], padding[3] = { 0, 0, 0 };
+    put_u32(header, 0x46546C67);
+    put_u32(header + 4, 2);
+    put_u32(header + 8, static_cast<std::uint32_t>(total));
+    put_u32(header + 12, static_cast<std::uint32_t>(json_chunk.size()));
+    put_u32(header + 16, 0x4E4F534A);
+    put_u32(bin_header, static_cast<std::uint32_t>(bin_chunk));
+    put_u32(bin_header + 4, 0x004E4942);
+    little_endian32(mesh.indices.data(), mesh.indices.size());
+    little_endian32(mesh.positions.values.data(), mesh.positions.values.size());
+    little_endian32(mesh.coordinates.values.data(),
+        mesh.coordinates.values.size());
+    std::vector<iovec> parts {
+        { header, sizeof(header) },
+        { &json_chunk[0], json_chunk.size() },
+        { bin_header, sizeof(bin_header) },
+        { mesh.indices.data(), index_len },
+        { mesh.positions.values.data(), vertex_len },
+        { mesh.coordinates.values.data(), coordinates_len },
+        { img.data(), img.size() },
+        { padding, bin_chunk - bin_len } };
+    int fd = open(Val.filename().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
         std::cerr << "Failed to open: " << Val.filename() << std::endl;
         return 1;
     }
-    out.write(&header.front(), header.size());
-    out.write(&json_chunk.front(), json_chunk.size());
-    out.write(&bin.front(), bin.size());
-    bool ok = out.good();
-    out.close();
-    return ok ? 0 : 2;
+    struct stat info;
+    bool regular = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+    bool ok = writev_all(fd, parts);
+    ok = (close(fd) == 0) && ok;
+    if (!ok) {
+        std::cerr << "Error writing to: " << Val.filename() << std::endl;
+        if (regular)
+            unlink(Val.filename().c_str());
+        return 2;
+    }
+    if (skip && regular)
+        store_digest(Val.filename(), value);
+    return 0;
 }
 
 int main(int argc, char** argv) {
@@ -13,16 +13,15 @@
 #else
 #include "convenience.hpp"
 #endif
+#include "mesh.hpp"
+#include "parallel.hpp"
 #include <iostream>
 #include <fcntl.h>
 #include <unistd.h>
 #include <vector>
-#include <cmath>
 #include <fstream>
 #include <cstddef>
 #include <cstdint>
-#include <sstream>
-#include <deque>
 
 
 static void base64encode(std::vector<char>& Out, const char* Src, size_t Len) {
@@ -51,27 +50,6 @@ static void base64encode(std::vector<char>& Out, const char* Src, size_t Len) {
     }
 }
 
-static size_t flatten(std::vector<float>& Out,
-    std::vector<float>& Min, std::vector<float>& Max,
-    const std::vector<std::vector<float>>& Src)
-{
-    Out.resize(0);
-    Out.reserve(Src.size() * 3);
-    Min.resize(3);
-    Max.resize(3);
-    for (size_t k = 0; k < 3; ++k)
-        Min[k] = Max[k] = Src.front()[k];
-    for (auto& vertex : Src)
-        for (size_t k = 0; k < 3; ++k) {
-            Out.push_back(vertex[k]);
-            if (Max[k] < vertex[k])
-                Max[k] = vertex[k];
-            else if (vertex[k] < Min[k])
-                Min[k] = vertex[k];
-        }
-    return Out.size() * sizeof(float);
-}
-
 static void buffer_object(std::ofstream& Out,
     const std::vector<char>& Buffer, size_t Length)
 {
@@ -80,19 +58,48 @@ static void buffer_object(std::ofstream& Out,
         << R"GLTF(","byteLength":)GLTF" << Length << "}";
 }
 
-static void accessor_object(std::ofstream& Out, size_t Count,
-    const std::vector<float>& Min, const std::vector<float>& Max)
+static void accessor_object(std::ofstream& Out, size_t View,
+    const MeshAttribute& Attr)
 {
-    Out << R"GLTF({"bufferView":1,"byteOffset":0,"componentType":5126,"count":)GLTF"
-        << Count << R"GLTF(,"type":"VEC3","max":[)GLTF"
-        << Max[0] << ',' << Max[1] << ',' << Max[2] << R"GLTF(],"min":[)GLTF"
-        << Min[0] << ',' << Min[1] << ',' << Min[2] << "]}";
+    Out << R"GLTF({"bufferView":)GLTF" << View
+        << R"GLTF(,"byteOffset":0,"componentType":5126,"count":)GLTF"
+        << Attr.Count() << R"GLTF(,"type":"VEC)GLTF" << Attr.components
+        << R"GLTF(","max":[)GLTF";
+    for (size_t k = 0; k < Attr.components; ++k)
+        Out << (k ? "," : "") << Attr.maximum[k];
+    Out << R"GLTF(],"min":[)GLTF";
+    for (size_t k = 0; k < Attr.components; ++k)
+        Out << (k ? "," : "") << Attr.minimum[k];
+    Out << "]}";
 }
 
 #if !defined(UNITTEST)
 static int writegltf(io::WriteglTFIn& Val) {
     if (Val.filename().substr(Val.filename().size() - 5) != ".gltf")
         Val.filename() += ".gltf";
+    bool strips = false;
+    if (Val.primitivesGiven() && !primitives_option(strips, Val.primitives()))
+        return 1;
+    ThreadPool pool(0);
+    Mesh mesh;
+    if (!mesh_attribute(mesh.positions, Val.vertices(), 3, pool)) {
+        std::cerr << "Vertices must be arrays of 3 values." << std::endl;
+        return 1;
+    }
+    if (Val.colorsGiven() &&
+        (!mesh_attribute(mesh.colors, Val.colors(), 0, pool) ||
+        mesh.colors.components < 3 || 4 < mesh.colors.components ||
+        mesh.colors.Count() != mesh.positions.Count()))
+    {
+        std::cerr << "Colors must be arrays of 3 or 4 values, one per vertex."
+            << std::endl;
+        return 1;
+    }
+    if (!strips || !mesh_strip(mesh, Val.tristrips(), pool))
+        mesh_triangles(mesh, Val.tristrips(), pool);
+    little_endian32(mesh.indices.data(), mesh.indices.size());
+    little_endian32(mesh.positions.values.data(), mesh.positions.values.size());
+    little_endian32(mesh.colors.values.data(), mesh.colors.values.size());
     std::ofstream out(Val.filename().c_str());
     if (out.fail()) {
         std::cerr << "Failed to open: " << Val.filename() << std::endl;
@@ -102,62 +109,45 @@ static int writegltf(io::WriteglTFIn& Val) {
 "meshes":[{"primitives":[{"attributes":{"POSITION":1)GLTF";
     if (Val.colorsGiven())
         out << R"GLTF(,"COLOR_0":2)GLTF";
-    out << R"GLTF(},"indices":0}]}],)GLTF";
-    // Convert all tri-strips (and later fans) to triangles.
-    std::vector<std::uint32_t> tris;
-    for (auto& strip : Val.tristrips())
-        for (size_t k = 0; k < strip.size() - 2; ++k) {
-            tris.push_back(strip[k]);
-            if (k & 1) {
-                tris.push_back(strip[k + 2]);
-                tris.push_back(strip[k + 1]);
-            } else {
-                tris.push_back(strip[k + 1]);
-                tris.push_back(strip[k + 2]);
-            }
-        }
+    out << R"GLTF(},"indices":0)GLTF";
+    if (mesh.strip)
+        out << R"GLTF(,"mode":5)GLTF";
+    out << R"GLTF(}]}],)GLTF";
     std::vector<char> buffer;
-    size_t index_len = tris.size() * sizeof(std::uint32_t);
-    base64encode(buffer, reinterpret_cast<const char*>(&(tris.front())),
-        index_len);
+    base64encode(buffer, reinterpret_cast<const char*>(mesh.indices.data()),
+        mesh.IndexBytes());
     out << R"GLTF("buffers":[)GLTF";
-    buffer_object(out, buffer, index_len);
-    std::vector<float> flat, vertex_max, vertex_min;
-    size_t vertex_len = flatten(flat, vertex_min, vertex_max, Val.vertices());
-    base64encode(buffer, reinterpret_cast<const char*>(&(flat.front())),
-        vertex_len);
+    buffer_object(out, buffer, mesh.IndexBytes());
+    base64encode(buffer,
+        reinterpret_cast<const char*>(mesh.positions.values.data()),
+        mesh.positions.Bytes());
     out << ",\n";
-    buffer_object(out, buffer, vertex_len);
-    size_t color_len = 0;
-    std::vector<float> color_max, color_min;
+    buffer_object(out, buffer, mesh.positions.Bytes());
     if (Val.colorsGiven()) {
-        color_len = flatten(flat, color_min, color_max, Val.colors());
-        base64encode(buffer, reinterpret_cast<const char*>(&(flat.front())),
-            color_len);
+        base64encode(buffer,
+            reinterpret_cast<const char*>(mesh.colors.values.data()),
+            mesh.colors.Bytes());
         out << ",\n";
-        buffer_object(out, buffer, color_len);
+        buffer_object(out, buffer, mesh.colors.Bytes());
     }
     out << R"GLTF(],
 "bufferViews":[{"buffer":0,"byteOffset":0,"byteLength":)GLTF"
-        << index_len << R"GLTF(,"target":34963},
+        << mesh.IndexBytes() << R"GLTF(,"target":34963},
 {"buffer":1,"byteOffset":0,"byteLength":)GLTF"
-        << vertex_len << R"GLTF(,"target":34962})GLTF";
+        << mesh.positions.Bytes() << R"GLTF(,"target":34962})GLTF";
     if (Val.colorsGiven())
         out << R"GLTF(,
 {"buffer":2,"byteOffset":0,"byteLength":)GLTF"
-            << color_len << R"GLTF(,"target":34962})GLTF";
+            << mesh.colors.Bytes() << R"GLTF(,"target":34962})GLTF";
     out << R"GLTF(],
 "accessors":[{"bufferView":0,"byteOffset":0,"componentType":5125,"count":)GLTF"
-        << (index_len / sizeof(std::uint32_t))
-        << R"GLTF(,"type":"SCALAR","max":[)GLTF"
-        << vertex_len / (sizeof(float) * 3) - 1
-        << R"GLTF(],"min":[0]},)GLTF" << "\n";
-    accessor_object(out,
-        vertex_len / (sizeof(float) * 3), vertex_min, vertex_max);
+        << mesh.indices.size()
+        << R"GLTF(,"type":"SCALAR","max":[)GLTF" << mesh.index_maximum
+        << R"GLTF(],"min":[)GLTF" << mesh.index_minimum << "]},\n";
+    accessor_object(out, 1, mesh.positions);
     if (Val.colorsGiven()) {
         out << ",\n";
-        accessor_object(out,
-            color_len / (sizeof(float) * 3), color_min, color_max);
+        accessor_object(out, 2, mesh.colors);
     }
     out << R"GLTF(],
 "asset":{"version":"2.0"}})GLTF";
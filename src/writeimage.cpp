@@ -7,233 +7,801 @@
 // Licensed under Universal Permissive License. See License.txt.
 
 #include "writeimage_io.hpp"
-#include "convenience.hpp"
+#include "streaming.hpp"
+#include "sink.hpp"
+#include "digest.hpp"
 #include "memimage.hpp"
+#include "parallel.hpp"
+#include "quantize.hpp"
 #include <iostream>
 #include <fcntl.h>
 #include <unistd.h>
 #include <vector>
 #include <cmath>
-#include <fstream>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <sstream>
+#include <string>
 #include <deque>
+#include <charconv>
+#include <cctype>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <sys/stat.h>
 #if !defined(NO_TIFF)
+#include <cstdio>
 #include <tiffio.h>
 #endif
 #if !defined(NO_PNG)
-#include <memory>
 #include <csetjmp>
 #include <png.h>
 #endif
 
 
-typedef int (*WriteFunc)(const io::WriteImageIn::filenameType&, const io::WriteImageIn::imageType&, io::WriteImageIn::depthType);
+// Rows to pack at a time so that all threads have work but memory use stays
+// limited.
+static size_t batch_rows(size_t RowSize, const ThreadPool& Pool) {
+    size_t rows = (size_t(16) << 20) / RowSize;
+    if (rows < 16 * Pool.Size())
+        rows = 16 * Pool.Size();
+    return rows;
+}
+
+// Output written with file system calls goes through this, so that the next
+// image is encoded while the previous one is still being written.
+static WriteBehind write_behind;
+
+// Opens Filename and passes it to write_behind. Returns false on error.
+static bool open_output(const std::string& Filename, size_t& File) {
+    int fd = open(Filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        std::cerr << "Failed to open output file: " << Filename << std::endl;
+        return false;
+    }
+    File = write_behind.Open(fd, Filename);
+    return true;
+}
+
+// Waits until the closed output is written and removes it if it is a
+// regular file. For errors that the background writer did not see.
+static void remove_output(const std::string& Filename) {
+    write_behind.Wait(Filename);
+    struct stat st;
+    if (stat(Filename.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+        unlink(Filename.c_str());
+}
+
+// Reports files that failed in the background, in the order they were
+// opened. Wait waits for all files to be closed. Returns 2 if any failed.
+static int report_written(bool Wait) {
+    int status = 0;
+    std::string name;
+    bool ok;
+    while (write_behind.Closed(name, ok, Wait))
+        if (!ok) {
+            std::cerr << "Error writing to output: " << name << std::endl;
+            status = 2;
+        }
+    return status;
+}
+
+// Settings that only some formats use.
+struct WriteOptions {
+#if !defined(NO_TIFF)
+    std::uint16_t tiff_compression;
+    size_t tiff_tile, tiff_levels;
+    bool tiff_append;
+#endif
+#if !defined(NO_PNG)
+    PNGProfile png;
+#endif
+    bool skip_unchanged;
+};
+
+typedef int (*WriteFunc)(const io::WriteImageIn::filenameType&, const io::WriteImageIn::imageType&, io::WriteImageIn::depthType, const Quantizer&, ThreadPool&, const WriteOptions&);
 
 #if !defined(NO_TIFF)
 
-static int writeTIFF(const io::WriteImageIn::filenameType& filename,
-    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth)
-{
-    TIFF* t = TIFFOpen(filename.c_str(), "w");
-    if (!t) {
-        std::cerr << "Failed to open output file: " << filename << std::endl;
-        return 1;
+// In-memory file for libtiff so that each thread can compress strips using
+// a TIFF handle of its own.
+struct MemoryFile {
+    std::vector<unsigned char> data;
+    toff_t position = 0;
+};
+
+static tmsize_t memory_read(thandle_t Handle, void* Buffer, tmsize_t Size) {
+    MemoryFile* m = static_cast<MemoryFile*>(Handle);
+    if (m->data.size() <= m->position)
+        return 0;
+    tmsize_t count = std::min(Size,
+        static_cast<tmsize_t>(m->data.size() - m->position));
+    memcpy(Buffer, &m->data[m->position], count);
+    m->position += count;
+    return count;
+}
+
+static tmsize_t memory_write(thandle_t Handle, void* Buffer, tmsize_t Size) {
+    MemoryFile* m = static_cast<MemoryFile*>(Handle);
+    if (m->data.size() < m->position + Size)
+        m->data.resize(m->position + Size);
+    memcpy(&m->data[m->position], Buffer, Size);
+    m->position += Size;
+    return Size;
+}
+
+static toff_t memory_seek(thandle_t Handle, toff_t Offset, int Whence) {
+    MemoryFile* m = static_cast<MemoryFile*>(Handle);
+    switch (Whence) {
+    case SEEK_SET: m->position = Offset; break;
+    case SEEK_CUR: m->position += Offset; break;
+    case SEEK_END: m->position = m->data.size() + Offset; break;
+    }
+    return m->position;
+}
+
+static int memory_close(thandle_t Handle) {
+    return 0;
+}
+
+static toff_t memory_size(thandle_t Handle) {
+    return static_cast<MemoryFile*>(Handle)->data.size();
+}
+
+static int memory_map(thandle_t Handle, void** Base, toff_t* Size) {
+    return 0;
+}
+
+static void memory_unmap(thandle_t Handle, void* Base, toff_t Size) { }
+
+// Layout of one image in the file, as strips or tiles.
+struct TIFFLayout {
+    size_t width, height, components;
+    io::WriteImageIn::depthType depth;
+    bool tiled;
+    // Tile size, or image width and rows per strip.
+    size_t chunk_width, chunk_height;
+
+    size_t pixel_size() const { return components * ((8 < depth) ? 2 : 1); }
+    size_t row_size() const { return width * pixel_size(); }
+    size_t across() const {
+        return tiled ? (width + chunk_width - 1) / chunk_width : 1;
     }
-    TIFFSetField(t, TIFFTAG_IMAGEWIDTH,
-        static_cast<std::uint32_t>(image[0].size()));
-    TIFFSetField(t, TIFFTAG_IMAGELENGTH,
-        static_cast<std::uint32_t>(image.size()));
+};
+
+// Strips of about 128 KiB, or Tile by Tile tiles if Tile is not 0.
+static TIFFLayout tiff_layout(size_t Width, size_t Height, size_t Components,
+    io::WriteImageIn::depthType depth, size_t Tile)
+{
+    TIFFLayout l { Width, Height, Components, depth, 0 < Tile, Width, Tile };
+    if (!l.tiled)
+        l.chunk_height = std::max(size_t(1), (size_t(128) << 10) / l.row_size());
+    else
+        l.chunk_width = Tile;
+    return l;
+}
+
+// Sets fields that the output file and chunk encoders share.
+static void set_tiff_fields(TIFF* t, const TIFFLayout& L,
+    std::uint16_t Compression)
+{
+    TIFFSetField(t, TIFFTAG_IMAGEWIDTH, static_cast<std::uint32_t>(L.width));
+    TIFFSetField(t, TIFFTAG_IMAGELENGTH, static_cast<std::uint32_t>(L.height));
     TIFFSetField(t, TIFFTAG_SAMPLESPERPIXEL,
-        static_cast<std::uint16_t>(image[0][0].size()));
-    TIFFSetField(t, TIFFTAG_BITSPERSAMPLE, static_cast<std::uint16_t>(depth));
+        static_cast<std::uint16_t>(L.components));
+    TIFFSetField(t, TIFFTAG_BITSPERSAMPLE, static_cast<std::uint16_t>(L.depth));
     TIFFSetField(t, TIFFTAG_MAXSAMPLEVALUE,
-        static_cast<std::uint16_t>((1 << depth) - 1));
+        static_cast<std::uint16_t>((1 << L.depth) - 1));
     TIFFSetField(t, TIFFTAG_MINSAMPLEVALUE, 0);
-    TIFFSetField(t, TIFFTAG_COMPRESSION, static_cast<std::uint16_t>(1));
+    TIFFSetField(t, TIFFTAG_COMPRESSION, Compression);
+    if (Compression != COMPRESSION_NONE)
+        TIFFSetField(t, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+    if (L.tiled) {
+        TIFFSetField(t, TIFFTAG_TILEWIDTH,
+            static_cast<std::uint32_t>(L.chunk_width));
+        TIFFSetField(t, TIFFTAG_TILELENGTH,
+            static_cast<std::uint32_t>(L.chunk_height));
+    } else
+        TIFFSetField(t, TIFFTAG_ROWSPERSTRIP,
+            static_cast<std::uint32_t>(L.chunk_height));
     TIFFSetField(t, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField(t, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-    if (image[0][0].size() < 3) {
+    if (L.components < 3) {
         TIFFSetField(t, TIFFTAG_PHOTOMETRIC, static_cast<std::uint16_t>(1));
-        if (image[0][0].size() == 2) {
+        if (L.components == 2) {
             std::uint16_t other(2);
             TIFFSetField(t, TIFFTAG_EXTRASAMPLES,
                 static_cast<std::uint16_t>(1), &other);
         }
     } else {
         TIFFSetField(t, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-        if (image[0][0].size() > 3) {
+        if (L.components > 3) {
             // Guess that the first is unassociated alpha and the rest unknown.
             std::vector<std::uint16_t> other;
             other.push_back(2);
-            for (size_t k = 4; k < image[0][0].size(); ++k)
+            for (size_t k = 4; k < L.components; ++k)
                 other.push_back(0);
             TIFFSetField(t, TIFFTAG_EXTRASAMPLES,
                 static_cast<std::uint16_t>(other.size()), &other.front());
         }
     }
-    std::uint32_t count = 0;
-    std::vector<unsigned char> buf;
-    buf.reserve(image[0].size() * image[0][0].size() * ((8 < depth) ? 2 : 1));
-    for (auto& line : image) {
-        buf.resize(0);
-        for (auto& pixel : line)
-            if (depth == 8)
-                for (auto& component : pixel)
-                    buf.push_back(static_cast<unsigned char>(component));
-            else
-                for (auto& component : pixel) {
-                    buf.push_back(0);
-                    buf.push_back(0);
-                    *reinterpret_cast<std::uint16_t*>((&buf.back()) - 1) =
-                        static_cast<std::uint16_t>(component);
+}
+
+// Compresses a strip of Rows rows or a full tile in Data to Out by writing it
+// as the only chunk of an in-memory TIFF. Predictor may modify Data.
+static bool encode_chunk(std::vector<unsigned char>& Out, unsigned char* Data,
+    size_t Rows, const TIFFLayout& L, std::uint16_t Compression)
+{
+    MemoryFile m;
+    TIFF* t = TIFFClientOpen("chunk", "wm", static_cast<thandle_t>(&m),
+        &memory_read, &memory_write, &memory_seek, &memory_close,
+        &memory_size, &memory_map, &memory_unmap);
+    if (!t)
+        return false;
+    TIFFLayout chunk = L;
+    chunk.width = L.chunk_width;
+    chunk.height = chunk.chunk_height = L.tiled ? L.chunk_height : Rows;
+    set_tiff_fields(t, chunk, Compression);
+    std::uint64_t* offsets = nullptr;
+    std::uint64_t* counts = nullptr;
+    tmsize_t size = static_cast<tmsize_t>(chunk.height * chunk.row_size());
+    bool ok = (L.tiled ?
+            TIFFWriteEncodedTile(t, 0, static_cast<tdata_t>(Data), size) :
+            TIFFWriteEncodedStrip(t, 0, static_cast<tdata_t>(Data), size))
+            != -1 &&
+        TIFFGetField(t, L.tiled ? TIFFTAG_TILEOFFSETS : TIFFTAG_STRIPOFFSETS,
+            &offsets) &&
+        TIFFGetField(t, L.tiled ? TIFFTAG_TILEBYTECOUNTS :
+            TIFFTAG_STRIPBYTECOUNTS, &counts);
+    if (ok)
+        Out.assign(m.data.begin() + offsets[0],
+            m.data.begin() + offsets[0] + counts[0]);
+    TIFFCleanup(t);
+    return ok;
+}
+
+// Writes packed rows [First, First + Rows) in Band as raw strips or tiles.
+// First is a multiple of chunk height. Chunks are copied and compressed in
+// parallel and written in order.
+static bool write_band(TIFF* t, const TIFFLayout& L, unsigned char* Band,
+    size_t First, size_t Rows, std::uint16_t Compression, ThreadPool& pool)
+{
+    const size_t row_size = L.row_size();
+    const size_t across = L.across();
+    const size_t down = (Rows + L.chunk_height - 1) / L.chunk_height;
+    const size_t count = across * down;
+    // Uncompressed strips are written from Band directly.
+    const bool direct = !L.tiled && Compression == COMPRESSION_NONE;
+    std::vector<std::vector<unsigned char>> chunks(direct ? 0 : count);
+    std::vector<char> ok(count, 1);
+    auto chunk_rows = [&](size_t Down) {
+        return std::min(L.chunk_height, Rows - Down * L.chunk_height);
+    };
+    if (!direct)
+        pool.Ranges(count, 1, [&](size_t Part, size_t Begin, size_t End) {
+            std::vector<unsigned char> tile;
+            for (size_t k = Begin; k < End; ++k) {
+                size_t y = (k / across) * L.chunk_height;
+                unsigned char* data = Band + y * row_size;
+                if (L.tiled) {
+                    // Partial tiles are padded with zeros.
+                    size_t x = (k % across) * L.chunk_width * L.pixel_size();
+                    size_t tile_row = L.chunk_width * L.pixel_size();
+                    size_t width = std::min(tile_row, row_size - x);
+                    tile.assign(L.chunk_height * tile_row, 0);
+                    for (size_t r = 0; r < chunk_rows(k / across); ++r)
+                        memcpy(&tile[r * tile_row], data + r * row_size + x,
+                            width);
+                    data = tile.data();
                 }
-        if (TIFFWriteScanline(t, static_cast<tdata_t>(&buf.front()), count++, 0) != 1)
-        {
-            TIFFClose(t);
-            std::cerr << "Error writing to output: " << filename << std::endl;
-            unlink(filename.c_str());
-            return 2;
+                if (Compression == COMPRESSION_NONE)
+                    chunks[k].swap(tile);
+                else
+                    ok[k] = encode_chunk(chunks[k], data,
+                        chunk_rows(k / across), L, Compression);
+            }
+        });
+    if (std::find(ok.begin(), ok.end(), 0) != ok.end()) {
+        std::cerr << "Error compressing image data.\n";
+        return false;
+    }
+    const size_t first = (First / L.chunk_height) * across;
+    for (size_t k = 0; k < count; ++k) {
+        unsigned char* data = nullptr;
+        size_t size = 0;
+        if (direct) {
+            data = Band + k * L.chunk_height * row_size;
+            size = chunk_rows(k) * row_size;
+        } else {
+            data = chunks[k].data();
+            size = chunks[k].size();
         }
+        if ((L.tiled ?
+            TIFFWriteRawTile(t, static_cast<std::uint32_t>(first + k),
+                static_cast<tdata_t>(data), static_cast<tmsize_t>(size)) :
+            TIFFWriteRawStrip(t, static_cast<std::uint32_t>(first + k),
+                static_cast<tdata_t>(data), static_cast<tmsize_t>(size)))
+            == -1)
+                return false;
     }
-    TIFFClose(t);
-    return 0;
+    return true;
 }
-#endif
 
+// Averages 2 by 2 pixel blocks of packed Src rows into Dst rows
+// [First, Last). Edge pixels are repeated for odd sizes.
 template<typename T>
-class Buffer : public std::vector<T> {
+static void downsample(T* Dst, const T* Src, const TIFFLayout& From,
+    size_t First, size_t Last)
+{
+    const size_t c = From.components;
+    const size_t width = (From.width + 1) / 2;
+    const size_t src_row = From.width * c;
+    for (size_t r = First; r < Last; ++r) {
+        const T* top = Src + 2 * r * src_row;
+        const T* bottom = (2 * r + 1 < From.height) ? top + src_row : top;
+        T* out = Dst + r * width * c;
+        for (size_t x = 0; x < width; ++x) {
+            size_t right = (2 * x + 1 < From.width) ? c : 0;
+            for (size_t k = 0; k < c; ++k) {
+                size_t left = 2 * x * c + k;
+                *out++ = static_cast<T>((std::uint32_t(top[left]) +
+                    top[left + right] + bottom[left] + bottom[left + right] + 2)
+                    >> 2);
+            }
+        }
+    }
+}
+
+// Downsamples Rows rows of From starting at even row First into To.
+static void downsample_rows(unsigned char* To, const unsigned char* From,
+    const TIFFLayout& Layout, size_t First, size_t Rows, ThreadPool& pool)
+{
+    const size_t first = First / 2;
+    const size_t count = (Rows + 1) / 2;
+    TIFFLayout band = Layout;
+    band.height = Rows;
+    const size_t row_size = ((Layout.width + 1) / 2) * Layout.pixel_size();
+    pool.Ranges(count, 16, [&](size_t Part, size_t Begin, size_t End) {
+        if (8 < Layout.depth)
+            downsample(reinterpret_cast<std::uint16_t*>(To + first * row_size),
+                reinterpret_cast<const std::uint16_t*>(From), band, Begin, End);
+        else
+            downsample(To + first * row_size, From, band, Begin, End);
+    });
+}
+
+// Classic TIFF has 32-bit offsets. Estimate allows for compression expanding
+// data that does not compress, for chunk offsets and for directories.
+static bool needs_bigtiff(const std::vector<TIFFLayout>& Images,
+    bool Compressed)
+{
+    std::uint64_t size = std::uint64_t(1) << 20;
+    for (auto& l : Images) {
+        std::uint64_t down = (l.height + l.chunk_height - 1) / l.chunk_height;
+        std::uint64_t data = l.tiled ?
+            down * l.across() * l.chunk_height * l.chunk_width * l.pixel_size() :
+            std::uint64_t(l.height) * l.row_size();
+        size += data + (Compressed ? data / 64 : 0) + down * l.across() * 16;
+    }
+    return (std::uint64_t(1) << 32) <= size;
+}
+
+// File for libtiff that ignores writes once the page being written is
+// discarded, as closing would otherwise write its directory.
+struct PageFile {
+    int fd = -1;
+    bool discarded = false;
+};
+
+static tmsize_t page_read(thandle_t Handle, void* Buffer, tmsize_t Size) {
+    return read(static_cast<PageFile*>(Handle)->fd, Buffer, Size);
+}
+
+static tmsize_t page_write(thandle_t Handle, void* Buffer, tmsize_t Size) {
+    PageFile* f = static_cast<PageFile*>(Handle);
+    if (f->discarded)
+        return Size;
+    return write_all(f->fd, static_cast<const unsigned char*>(Buffer), Size) ?
+        Size : -1;
+}
+
+static toff_t page_seek(thandle_t Handle, toff_t Offset, int Whence) {
+    return lseek(static_cast<PageFile*>(Handle)->fd,
+        static_cast<off_t>(Offset), Whence);
+}
+
+static int page_close(thandle_t Handle) {
+    return close(static_cast<PageFile*>(Handle)->fd);
+}
+
+static toff_t page_size(thandle_t Handle) {
+    struct stat st;
+    return (fstat(static_cast<PageFile*>(Handle)->fd, &st) == 0) ?
+        st.st_size : 0;
+}
+
+// TIFF file kept open while images are appended to it as pages, so that a
+// sequence of images does not reopen the file for each page.
+class TIFFPages {
+private:
+    std::string filename;
+    PageFile file;
+    TIFF* t;
+
 public:
-    Buffer& operator<<(T c) {
-        this->push_back(c);
-        return *this;
+    TIFFPages() : t(nullptr) { }
+    ~TIFFPages() { Close(); }
+
+    // Returns file ready for a new page. File is created if needed.
+    TIFF* Open(const std::string& Filename, bool BigTIFF) {
+        if (t && Filename == filename)
+            return t;
+        Close();
+        file.fd = open(Filename.c_str(), O_RDWR | O_CREAT, 0666);
+        if (file.fd < 0)
+            return nullptr;
+        file.discarded = false;
+        t = TIFFClientOpen(Filename.c_str(), BigTIFF ? "a8" : "a",
+            static_cast<thandle_t>(&file), &page_read, &page_write,
+            &page_seek, &page_close, &page_size, &memory_map, &memory_unmap);
+        if (t)
+            filename = Filename;
+        else
+            close(file.fd);
+        return t;
     }
 
-    Buffer& write_u32(std::uint32_t s) {
-        this->push_back((s >> 24) & 0xff);
-        this->push_back((s >> 16) & 0xff);
-        this->push_back((s >> 8) & 0xff);
-        this->push_back(s & 0xff);
-        return *this;
+    void Close() {
+        if (t)
+            TIFFClose(t);
+        t = nullptr;
+        filename.clear();
+    }
+
+    // Closes the file without writing the page being written, so that it
+    // has the Pages written before.
+    void Discard(tdir_t Pages) {
+        // Directory is written before its sub-IFDs.
+        if (t && Pages < TIFFNumberOfDirectories(t))
+            TIFFUnlinkDirectory(t, Pages + 1);
+        file.discarded = true;
+        Close();
     }
 };
 
-#if !defined(NO_PNG)
+static TIFFPages tiff_pages;
 
-static int write_png(const char* filename,
-    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth)
+static int writeTIFF(const io::WriteImageIn::filenameType& filename,
+    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth,
+    const Quantizer& q, ThreadPool& pool, const WriteOptions& options)
 {
-    std::ofstream out;
-    out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-    out.open(filename,
-        std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
-    std::vector<unsigned char> buf = memoryPNG(image, depth);
-    if (buf.empty())
+    if (std::numeric_limits<std::uint32_t>::max() < image.size() ||
+        std::numeric_limits<std::uint32_t>::max() < image[0].size())
+    {
+        std::cerr << "Image too large for TIFF.\n";
         return 1;
-    out.write(reinterpret_cast<char*>(&buf.front()), buf.size());
-    out.close();
+    }
+    TIFFLayout layout = tiff_layout(image[0].size(), image.size(),
+        image[0][0].size(), depth, options.tiff_tile);
+    // Reduced resolution levels are kept in memory as sub-IFDs.
+    std::vector<TIFFLayout> levels;
+    for (size_t w = layout.width, h = layout.height;
+        (1 < w || 1 < h) && levels.size() < options.tiff_levels;)
+    {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        levels.push_back(tiff_layout(w, h, layout.components, depth,
+            options.tiff_tile));
+    }
+    std::vector<TIFFLayout> all(1, layout);
+    all.insert(all.end(), levels.begin(), levels.end());
+    const bool bigtiff =
+        needs_bigtiff(all, options.tiff_compression != COMPRESSION_NONE);
+    TIFF* t = options.tiff_append ? tiff_pages.Open(filename, bigtiff) :
+        TIFFOpen(filename.c_str(), bigtiff ? "w8" : "w");
+    if (!t) {
+        std::cerr << "Failed to open output file: " << filename << std::endl;
+        return 1;
+    }
+    // Pages already in the file are kept.
+    const tdir_t pages = options.tiff_append ? TIFFNumberOfDirectories(t) : 0;
+    auto fail = [&]() {
+        std::cerr << "Error writing to output: " << filename << std::endl;
+        if (options.tiff_append) {
+            tiff_pages.Discard(pages);
+            if (pages == 0)
+                unlink(filename.c_str());
+        } else {
+            TIFFClose(t);
+            unlink(filename.c_str());
+        }
+        return 2;
+    };
+    set_tiff_fields(t, layout, options.tiff_compression);
+    if (!levels.empty()) {
+        std::vector<toff_t> offsets(levels.size(), 0);
+        TIFFSetField(t, TIFFTAG_SUBIFD,
+            static_cast<std::uint16_t>(levels.size()), &offsets.front());
+    }
+    std::vector<unsigned char> level, next;
+    if (!levels.empty())
+        level.resize(levels[0].height * levels[0].row_size());
+    const size_t row_size = layout.row_size();
+    // Bands of whole chunks and an even number of rows.
+    const size_t band = 2 * layout.chunk_height;
+    const size_t batch = band * ((batch_rows(row_size, pool) + band - 1) / band);
+    std::vector<unsigned char> buf(batch * row_size);
+    for (size_t first = 0; first < image.size(); first += batch) {
+        size_t last = std::min(first + batch, image.size());
+        q.pack_rows(pool, (depth == 8) ? &Quantizer::pack8 : &Quantizer::pack16,
+            &buf.front(), row_size, image, first, last);
+        // Before writing since predictor may change buf.
+        if (!levels.empty())
+            downsample_rows(&level.front(), &buf.front(), layout, first,
+                last - first, pool);
+        if (!write_band(t, layout, &buf.front(), first, last - first,
+            options.tiff_compression, pool))
+                return fail();
+    }
+    buf = std::vector<unsigned char>();
+    for (size_t k = 0; k < levels.size(); ++k) {
+        const TIFFLayout& l = levels[k];
+        bool ok = TIFFWriteDirectory(t);
+        if (ok) {
+            set_tiff_fields(t, l, options.tiff_compression);
+            TIFFSetField(t, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+            if (k + 1 < levels.size()) {
+                next.resize(levels[k + 1].height * levels[k + 1].row_size());
+                downsample_rows(&next.front(), &level.front(), l, 0, l.height,
+                    pool);
+            }
+            ok = write_band(t, l, &level.front(), 0, l.height,
+                options.tiff_compression, pool);
+            level.swap(next);
+        }
+        if (!ok)
+            return fail();
+    }
+    // Written directory makes the page complete in the file.
+    if (options.tiff_append)
+        return TIFFWriteDirectory(t) ? 0 : fail();
+    TIFFClose(t);
     return 0;
 }
+#endif
 
+#if !defined(NO_PNG)
+
+// Packs and compresses rows in batches straight to the file.
 static int writePNG(const io::WriteImageIn::filenameType& filename,
-    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth)
+    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth,
+    const Quantizer& q, ThreadPool& pool, const WriteOptions& options)
 {
-    try {
-        switch (write_png(filename.c_str(), image, depth)) {
-        case 0: return 0;
-        case 1:
-            std::cerr << "Error creating PNG.\n";
-            return 1;
-        }
-    }
-    catch (std::ofstream::failure& e) {
-        std::cerr << filename << ": " << e.what() << "\n";
+    size_t file;
+    if (!open_output(filename, file))
+        return 1;
+    FileSink sink(write_behind, file);
+    PNGEncoder enc(sink, image[0].size(), image.size(), image[0][0].size(),
+        depth, q, pool, options.png);
+    bool ok = enc.Append(image, 0, image.size()) && enc.Finish() &&
+        sink.Flush();
+    write_behind.Close(file);
+    if (!ok) {
+        std::cerr << "Error writing PNG: " << filename << std::endl;
+        write_behind.Wait(filename);
+        unlink(filename.c_str());
         return 2;
     }
-    catch (const char* e) {
-        std::cerr << e << "\n";
-        return 3;
-    }
-    std::cerr << "Unspecified error.\n";
-    return 4;
+    return 0;
 }
 
 #endif
 
-// PPM, NetPBM color image binary format.
+// PPM, PGM and PAM, NetPBM binary formats. Only header differs. Height is
+// given as text so that a streamed image can leave room for it.
 
-static int writePPM(const io::WriteImageIn::filenameType& filename,
-    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth)
+static std::string netpbm_header(const char* Magic, size_t Width,
+    const std::string& Height, io::WriteImageIn::depthType depth)
 {
-    std::ofstream out;
-    out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-    out.open(filename,
-        std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
     std::stringstream header;
-    header << "P6\n" << image[0].size() << '\n' << image.size() << '\n'
+    header << Magic << '\n' << Width << '\n' << Height << '\n'
         << ((1 << depth) - 1) << '\n';
-    out << header.str();
-    Buffer<char> buf;
-    for (auto& line : image)
-        for (auto& pixel : line)
-            for (auto& component : pixel)
-                if (depth == 8)
-                    buf << static_cast<char>(static_cast<unsigned char>(
-                        component));
-                else {
-                    std::uint16_t val = static_cast<std::uint16_t>(component);
-                    buf << static_cast<char>((val >> 8) & 0xff)
-                        << static_cast<char>(val & 0xff);
-                }
-    out.write(&buf.front(), buf.size());
-    out.close();
-    return 0;
+    return header.str();
 }
 
-// PPM, NetPBM color image text format.
+static std::string pam_header(size_t Width, const std::string& Height,
+    size_t Components, io::WriteImageIn::depthType depth)
+{
+    std::stringstream header;
+    header << "P7\nWIDTH " << Width << "\nHEIGHT " << Height
+        << "\nDEPTH " << Components
+        << "\nMAXVAL " << ((1 << depth) - 1) << '\n';
+    switch (Components) {
+    case 1: header << "TUPLTYPE GRAYSCALE\n"; break;
+    case 2: header << "TUPLTYPE GRAYSCALE_ALPHA\n"; break;
+    case 3: header << "TUPLTYPE RGB\n"; break;
+    case 4: header << "TUPLTYPE RGB_ALPHA\n"; break;
+    }
+    header << "ENDHDR\n";
+    return header.str();
+}
 
-static int writePlainPPM(const io::WriteImageIn::filenameType& filename,
-    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth)
+// Packs and writes all rows in image using buf for batches.
+static bool write_netpbm_rows(ByteSink& out,
+    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth,
+    const Quantizer& q, ThreadPool& pool, std::vector<unsigned char>& buf)
 {
-    std::ofstream out;
-    out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-    out.open(filename, std::ofstream::out | std::ofstream::trunc);
-    out << "P3\n" << image[0].size() << '\n' << image.size() << '\n'
-        << (1 << depth) - 1 << '\n';
-    for (auto& line : image)
-        for (auto& pixel : line) // We know there are 3 components.
-            out << pixel[0] << ' ' << pixel[1] << ' ' << pixel[2] << '\n';
-    out.close();
-    return 0;
+    const size_t row_size =
+        image[0].size() * image[0][0].size() * ((8 < depth) ? 2 : 1);
+    const size_t batch = std::min(batch_rows(row_size, pool), image.size());
+    if (buf.size() < batch * row_size)
+        buf.resize(batch * row_size);
+    for (size_t first = 0; first < image.size(); first += batch) {
+        size_t last = std::min(first + batch, image.size());
+        q.pack_rows(pool,
+            (depth == 8) ? &Quantizer::pack8 : &Quantizer::pack16be,
+            &buf.front(), row_size, image, first, last);
+        if (!out.Write(&buf.front(), (last - first) * row_size))
+            return false;
+    }
+    return true;
 }
 
-static int write_image(io::WriteImageIn& val) {
-    if (val.image().empty()) {
-        std::cerr << "Image has zero height.\n";
-        return 1;
+static int write_netpbm(const io::WriteImageIn::filenameType& filename,
+    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth,
+    const Quantizer& q, ThreadPool& pool, const std::string& header)
+{
+    // Size is known so rows are packed in parallel to their place in file.
+    const size_t row_size =
+        image[0].size() * image[0][0].size() * ((8 < depth) ? 2 : 1);
+    MappedFile file;
+    if (file.Open(filename.c_str(), header.size() + image.size() * row_size)) {
+        memcpy(file.Data(), header.data(), header.size());
+        q.pack_rows(pool,
+            (depth == 8) ? &Quantizer::pack8 : &Quantizer::pack16be,
+            file.Data() + header.size(), row_size, image, 0, image.size());
+        if (!file.Close()) {
+            std::cerr << "Error writing to output: " << filename << std::endl;
+            return 2;
+        }
+        return 0;
     }
-    if (val.image()[0].empty()) {
-        std::cerr << "Image has zero width.\n";
+    // Not a regular file, or no space for it.
+    size_t out;
+    if (!open_output(filename, out))
         return 1;
+    FileSink sink(write_behind, out);
+    std::vector<unsigned char> buf;
+    bool ok = sink.Write(reinterpret_cast<const unsigned char*>(header.data()),
+        header.size()) && write_netpbm_rows(sink, image, depth, q, pool, buf) &&
+        sink.Flush();
+    write_behind.Close(out);
+    if (!ok) {
+        std::cerr << "Error writing to output: " << filename << std::endl;
+        remove_output(filename);
+        return 2;
     }
-    if (val.image()[0][0].empty()) {
-        std::cerr << "Image has zero depth.\n";
+    return 0;
+}
+
+static int writePPM(const io::WriteImageIn::filenameType& filename,
+    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth,
+    const Quantizer& q, ThreadPool& pool, const WriteOptions& options)
+{
+    return write_netpbm(filename, image, depth, q, pool,
+        netpbm_header("P6", image[0].size(), std::to_string(image.size()),
+            depth));
+}
+
+static int writePGM(const io::WriteImageIn::filenameType& filename,
+    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth,
+    const Quantizer& q, ThreadPool& pool, const WriteOptions& options)
+{
+    return write_netpbm(filename, image, depth, q, pool,
+        netpbm_header("P5", image[0].size(), std::to_string(image.size()),
+            depth));
+}
+
+static int writePAM(const io::WriteImageIn::filenameType& filename,
+    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth,
+    const Quantizer& q, ThreadPool& pool, const WriteOptions& options)
+{
+    return write_netpbm(filename, image, depth, q, pool,
+        pam_header(image[0].size(), std::to_string(image.size()),
+            image[0][0].size(), depth));
+}
+
+// PPM, NetPBM color image text format.
+
+// Formats all rows in image in parallel in batches and writes them in order.
+static bool write_plain_rows(ByteSink& out,
+    const io::WriteImageIn::imageType& image, const Quantizer& q,
+    ThreadPool& pool, std::vector<std::vector<char>>& buffers)
+{
+    const size_t pixel_chars = 3 * 6; // Up to 5 digits and separator.
+    const size_t row_chars = image[0].size() * pixel_chars;
+    size_t rows_per_part = (size_t(1) << 20) / row_chars;
+    if (rows_per_part == 0)
+        rows_per_part = 1;
+    const size_t parts = pool.Size();
+    buffers.resize(parts);
+    for (size_t first = 0; first < image.size();
+        first += parts * rows_per_part)
+    {
+        size_t last = first + parts * rows_per_part;
+        if (image.size() < last)
+            last = image.size();
+        pool.Ranges(last - first, rows_per_part,
+            [&](size_t Part, size_t Begin, size_t End) {
+                std::vector<char>& buf = buffers[Part];
+                buf.resize((End - Begin) * row_chars);
+                char* dst = buf.data();
+                char* const end = buf.data() + buf.size();
+                for (size_t r = first + Begin; r < first + End; ++r)
+                    for (auto& pixel : image[r]) // We know there are 3 components.
+                        for (size_t k = 0; k < 3; ++k) {
+                            dst = std::to_chars(dst, end,
+                                static_cast<unsigned int>(q(pixel[k]))).ptr;
+                            *dst++ = (k < 2) ? ' ' : '\n';
+                        }
+                buf.resize(dst - buf.data());
+            });
+        for (auto& buf : buffers)
+            if (!buf.empty()) {
+                if (!out.Write(reinterpret_cast<const unsigned char*>(
+                    buf.data()), buf.size()))
+                        return false;
+                buf.resize(0);
+            }
+    }
+    return true;
+}
+
+static int writePlainPPM(const io::WriteImageIn::filenameType& filename,
+    const io::WriteImageIn::imageType& image, io::WriteImageIn::depthType depth,
+    const Quantizer& q, ThreadPool& pool, const WriteOptions& options)
+{
+    size_t out;
+    if (!open_output(filename, out))
         return 1;
+    FileSink sink(write_behind, out);
+    std::string header = netpbm_header("P3", image[0].size(),
+        std::to_string(image.size()), depth);
+    std::vector<std::vector<char>> buffers;
+    bool ok = sink.Write(reinterpret_cast<const unsigned char*>(header.data()),
+        header.size()) && write_plain_rows(sink, image, q, pool, buffers) &&
+        sink.Flush();
+    write_behind.Close(out);
+    if (!ok) {
+        std::cerr << "Error writing to output: " << filename << std::endl;
+        remove_output(filename);
+        return 2;
     }
+    return 0;
+}
+
+// Format if given, otherwise file name extension or empty if there is none.
+static std::string output_format(const io::WriteImageIn& val) {
+    if (val.formatGiven())
+        return val.format();
+    size_t last = val.filename().find_last_of(".");
+    return (last == std::string::npos) ? std::string() :
+        val.filename().substr(last + 1);
+}
+
+// Sets writer for the format and depth to one the format supports.
+static int check_format(io::WriteImageIn& val, size_t Components,
+    WriteFunc& writer)
+{
     // Check type presence. If not given, use file name extension.
     if (!val.formatGiven()) {
-        size_t last = val.filename().find_last_of(".");
-        if (last == std::string::npos) {
+        val.format() = output_format(val);
+        if (val.format().empty()) {
             std::cerr << "No format nor extension in filename.\n";
             return 1;
         }
-        val.format() = val.filename().substr(last + 1);
     }
-    WriteFunc writer = nullptr;
-#if !defined(NO_TIFF)
-    bool tiff = false;
-#endif
     if (strcasecmp(val.format().c_str(), "ppm") == 0 ||
         strcasecmp(val.format().c_str(), "p6-ppm") == 0)
     {
@@ -243,9 +811,8 @@ static int write_image(io::WriteImageIn& val) {
             val.depth() = 16;
         else if (val.depth() <= 8)
             val.depth() = 8;
-        if (val.image()[0][0].size() != 3) {
-            std::cerr << "Got " << val.image()[0][0].size() <<
-                " color planes, not 3.\n";
+        if (Components != 3) {
+            std::cerr << "Got " << Components << " color planes, not 3.\n";
             return 1;
         }
     } else if (strcasecmp(val.format().c_str(), "p3-ppm") == 0) {
@@ -255,22 +822,42 @@ static int write_image(io::WriteImageIn& val) {
             val.depth() = 1;
         else if (16 < val.depth())
             val.depth() = 16;
-        if (val.image()[0][0].size() != 3) {
-            std::cerr << "Got " << val.image()[0][0].size() <<
-                " color planes, not 3.\n";
+        if (Components != 3) {
+            std::cerr << "Got " << Components << " color planes, not 3.\n";
             return 1;
         }
+    } else if (strcasecmp(val.format().c_str(), "pgm") == 0 ||
+        strcasecmp(val.format().c_str(), "p5-pgm") == 0)
+    {
+        // PGM-writer.
+        writer = &writePGM;
+        if (8 < val.depth())
+            val.depth() = 16;
+        else if (val.depth() <= 8)
+            val.depth() = 8;
+        if (Components != 1) {
+            std::cerr << "Got " << Components << " color planes, not 1.\n";
+            return 1;
+        }
+    } else if (strcasecmp(val.format().c_str(), "pam") == 0 ||
+        strcasecmp(val.format().c_str(), "p7-pam") == 0)
+    {
+        // PAM-writer, any number of planes.
+        writer = &writePAM;
+        if (8 < val.depth())
+            val.depth() = 16;
+        else if (val.depth() <= 8)
+            val.depth() = 8;
 #if !defined(NO_TIFF)
     } else if (strcasecmp(val.format().c_str(), "tiff") == 0 ||
         strcasecmp(val.format().c_str(), "tif") == 0)
     {
         // TIFF-writer.
-        tiff = true;
         writer = &writeTIFF;
-        if (8 < val.depth())
+        if (8 < val.depth() && 2 < Components)
             val.depth() = 16;
-        else if (val.depth() <= 8)
-            val.depth() = 8;
+        else
+            val.depth() = 8; // Grayscale TIFF does not support 16-bit depth.
 #endif
 #if !defined(NO_PNG)
     } else if (strcasecmp(val.format().c_str(), "png") == 0) {
@@ -280,9 +867,8 @@ static int write_image(io::WriteImageIn& val) {
             val.depth() = 16;
         else if (val.depth() <= 8)
             val.depth() = 8;
-        if (4 < val.image()[0][0].size()) {
-            std::cerr << "Too many color planes: " <<
-                val.image()[0][0].size() << std::endl;
+        if (4 < Components) {
+            std::cerr << "Too many color planes: " << Components << std::endl;
             return 1;
         }
 #endif
@@ -290,81 +876,844 @@ static int write_image(io::WriteImageIn& val) {
         std::cerr << "Unsupported format: " << val.format() << std::endl;
         return 1;
     }
+    return 0;
+}
+
+static int parse_options(const io::WriteImageIn& val, WriteOptions& options) {
+#if !defined(NO_TIFF)
+    options.tiff_compression = COMPRESSION_NONE;
+    if (val.compressionGiven()) {
+        if (strcasecmp(val.compression().c_str(), "lzw") == 0)
+            options.tiff_compression = COMPRESSION_LZW;
+        else if (strcasecmp(val.compression().c_str(), "deflate") == 0)
+            options.tiff_compression = COMPRESSION_ADOBE_DEFLATE;
+#if defined(COMPRESSION_ZSTD)
+        else if (strcasecmp(val.compression().c_str(), "zstd") == 0)
+            options.tiff_compression = COMPRESSION_ZSTD;
+#endif
+        else if (strcasecmp(val.compression().c_str(), "none") != 0) {
+            std::cerr << "Unsupported compression: " << val.compression()
+                << std::endl;
+            return 1;
+        }
+        if (!TIFFIsCODECConfigured(options.tiff_compression)) {
+            std::cerr << "Compression not supported by libtiff: "
+                << val.compression() << std::endl;
+            return 1;
+        }
+    }
+    // Tile size has to be a multiple of 16.
+    options.tiff_tile = (val.tileGiven() && 0 < val.tile()) ?
+        16 * ((static_cast<size_t>(val.tile()) + 15) / 16) : 0;
+    options.tiff_levels = (val.levelsGiven() && 0 < val.levels()) ?
+        static_cast<size_t>(val.levels()) : 0;
+    options.tiff_append = false;
+    if (val.existingGiven()) {
+        if (strcasecmp(val.existing().c_str(), "append") == 0)
+            options.tiff_append = true;
+        else if (strcasecmp(val.existing().c_str(), "replace") != 0) {
+            std::cerr << "Unsupported action for existing file: "
+                << val.existing() << std::endl;
+            return 1;
+        }
+    }
+#endif
+#if !defined(NO_PNG)
+    options.png = PNGBalanced;
+    if (val.profileGiven()) {
+        if (strcasecmp(val.profile().c_str(), "speed") == 0)
+            options.png = PNGSpeed;
+        else if (strcasecmp(val.profile().c_str(), "size") == 0)
+            options.png = PNGSize;
+        else if (strcasecmp(val.profile().c_str(), "balanced") != 0) {
+            std::cerr << "Unsupported profile: " << val.profile() << std::endl;
+            return 1;
+        }
+    }
+#endif
+    if (val.streamGiven() && strcasecmp(val.stream().c_str(), "yes") != 0 &&
+        strcasecmp(val.stream().c_str(), "no") != 0)
+    {
+        std::cerr << "Unsupported value for stream: " << val.stream()
+            << std::endl;
+        return 1;
+    }
+    options.skip_unchanged = false;
+    if (val.unchangedGiven()) {
+        if (strcasecmp(val.unchanged().c_str(), "skip") == 0)
+            options.skip_unchanged = true;
+        else if (strcasecmp(val.unchanged().c_str(), "write") != 0) {
+            std::cerr << "Unsupported action for unchanged output: "
+                << val.unchanged() << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Region of an existing uncompressed file is overwritten in place when row
+// or column is given. The file header gives the layout.
+
+// Pixel (y, x) is in the chunk that covers it, strip or tile in TIFF. NetPBM
+// data is one chunk.
+struct ExistingLayout {
+    size_t width, height, components;
+    io::WriteImageIn::depthType depth;
+    size_t chunk_width, chunk_height, across;
+    std::vector<std::uint64_t> offsets;
+    Quantizer::Packer pack;
+
+    size_t pixel_size() const { return components * ((8 < depth) ? 2 : 1); }
+
+    std::uint64_t offset(size_t Y, size_t X) const {
+        return offsets[(Y / chunk_height) * across + X / chunk_width] +
+            ((Y % chunk_height) * chunk_width + X % chunk_width) * pixel_size();
+    }
+};
+
+// Next token in Header from Pos. Whitespace and comments are skipped.
+static std::string header_token(const std::string& Header, size_t& Pos) {
+    while (Pos < Header.size()) {
+        if (Header[Pos] == '#')
+            while (Pos < Header.size() && Header[Pos] != '\n')
+                ++Pos;
+        else if (isspace(static_cast<unsigned char>(Header[Pos])))
+            ++Pos;
+        else
+            break;
+    }
+    size_t start = Pos;
+    while (Pos < Header.size() &&
+        !isspace(static_cast<unsigned char>(Header[Pos])))
+            ++Pos;
+    return Header.substr(start, Pos - start);
+}
+
+static bool header_number(const std::string& Token, size_t& Value) {
+    auto result = std::from_chars(
+        Token.data(), Token.data() + Token.size(), Value);
+    return !Token.empty() && result.ec == std::errc() &&
+        result.ptr == Token.data() + Token.size();
+}
+
+static int existing_netpbm(int fd, const char* Magic, ExistingLayout& L) {
+    std::string header(4096, '\0');
+    ssize_t count = pread(fd, &header[0], header.size(), 0);
+    header.resize((count < 0) ? 0 : count);
+    size_t pos = 0, maxval = 0;
+    L.width = L.height = 0;
+    L.components = (Magic[1] == '6') ? 3 : 1;
+    bool ok = header_token(header, pos) == Magic;
+    if (ok && Magic[1] == '7') {
+        std::string key;
+        while (ok && (key = header_token(header, pos)) != "ENDHDR") {
+            size_t* target = nullptr;
+            if (key == "WIDTH")
+                target = &L.width;
+            else if (key == "HEIGHT")
+                target = &L.height;
+            else if (key == "DEPTH")
+                target = &L.components;
+            else if (key == "MAXVAL")
+                target = &maxval;
+            if (target != nullptr)
+                ok = header_number(header_token(header, pos), *target);
+            else {
+                // TUPLTYPE does not affect the layout.
+                while (pos < header.size() && header[pos] != '\n')
+                    ++pos;
+                ok = pos < header.size();
+            }
+        }
+    } else if (ok)
+        ok = header_number(header_token(header, pos), L.width) &&
+            header_number(header_token(header, pos), L.height) &&
+            header_number(header_token(header, pos), maxval);
+    // Single whitespace character separates header and data.
+    if (!ok || header.size() <= pos || L.width == 0 || L.height == 0 ||
+        L.components == 0 || (maxval != 255 && maxval != 65535))
+    {
+        std::cerr << "Unsupported header in existing file.\n";
+        return 1;
+    }
+    L.depth = (maxval == 255) ? 8 : 16;
+    L.chunk_width = L.width;
+    L.chunk_height = L.height;
+    L.across = 1;
+    L.offsets.assign(1, pos + 1);
+    L.pack = (L.depth == 8) ? &Quantizer::pack8 : &Quantizer::pack16be;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<std::uint64_t>(st.st_size) <
+        L.offsets[0] + std::uint64_t(L.height) * L.width * L.pixel_size())
+    {
+        std::cerr << "Existing file is shorter than its header indicates.\n";
+        return 1;
+    }
+    return 0;
+}
+
+#if !defined(NO_TIFF)
+static int existing_tiff(const char* Filename, ExistingLayout& L) {
+    TIFF* t = TIFFOpen(Filename, "r");
+    if (!t) {
+        std::cerr << "Failed to open: " << Filename << std::endl;
+        return 1;
+    }
+    std::uint32_t width = 0, height = 0, chunk_width = 0, chunk_height = 0;
+    std::uint16_t components = 1, depth = 1, compression = COMPRESSION_NONE,
+        planar = PLANARCONFIG_CONTIG, format = SAMPLEFORMAT_UINT;
+    std::uint16_t levels = 0;
+    std::uint64_t* level_offsets = nullptr;
+    TIFFGetField(t, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(t, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetFieldDefaulted(t, TIFFTAG_SAMPLESPERPIXEL, &components);
+    TIFFGetFieldDefaulted(t, TIFFTAG_BITSPERSAMPLE, &depth);
+    TIFFGetFieldDefaulted(t, TIFFTAG_COMPRESSION, &compression);
+    TIFFGetFieldDefaulted(t, TIFFTAG_PLANARCONFIG, &planar);
+    TIFFGetFieldDefaulted(t, TIFFTAG_SAMPLEFORMAT, &format);
+    TIFFGetField(t, TIFFTAG_SUBIFD, &levels, &level_offsets);
+    bool tiled = TIFFIsTiled(t);
+    if (tiled) {
+        TIFFGetField(t, TIFFTAG_TILEWIDTH, &chunk_width);
+        TIFFGetField(t, TIFFTAG_TILELENGTH, &chunk_height);
+    } else {
+        chunk_width = width;
+        TIFFGetFieldDefaulted(t, TIFFTAG_ROWSPERSTRIP, &chunk_height);
+        chunk_height = std::min(chunk_height, height);
+    }
+    L.width = width;
+    L.height = height;
+    L.components = components;
+    L.depth = depth;
+    L.chunk_width = chunk_width;
+    L.chunk_height = chunk_height;
+    L.across = (chunk_width == 0) ? 0 : (width + chunk_width - 1) / chunk_width;
+    L.pack = (depth == 8) ? &Quantizer::pack8 : &Quantizer::pack16;
+    const char* error = nullptr;
+    if (compression != COMPRESSION_NONE)
+        error = "Only uncompressed TIFF can be updated in place.";
+    else if (planar != PLANARCONFIG_CONTIG || format != SAMPLEFORMAT_UINT ||
+        (depth != 8 && depth != 16))
+            error = "Unsupported sample layout in existing TIFF.";
+    else if (levels != 0)
+        error = "Reduced resolution levels would not match updated image.";
+    else if (width == 0 || height == 0 || chunk_width == 0 ||
+        chunk_height == 0)
+            error = "Invalid image or chunk size in existing TIFF.";
+    else if (depth == 16 && TIFFIsByteSwapped(t)) {
+        // Only the byte order of this or big-endian machine can be packed.
+        if (TIFFIsBigEndian(t))
+            L.pack = &Quantizer::pack16be;
+        else
+            error = "Unsupported byte order in existing TIFF.";
+    }
+    if (error == nullptr) {
+        const size_t count =
+            tiled ? TIFFNumberOfTiles(t) : TIFFNumberOfStrips(t);
+        for (size_t k = 0; k < count && error == nullptr; ++k) {
+            // Last strip may have fewer rows.
+            size_t rows = tiled ? chunk_height :
+                std::min(size_t(chunk_height), height - k * chunk_height);
+            L.offsets.push_back(TIFFGetStrileOffset(t, k));
+            if (TIFFGetStrileByteCount(t, k) <
+                std::uint64_t(rows) * chunk_width * L.pixel_size())
+                    error = "Existing TIFF has less data than image needs.";
+        }
+        if (error == nullptr && L.offsets.size() <
+            L.across * ((height + chunk_height - 1) / chunk_height))
+                error = "Existing TIFF has less data than image needs.";
+    }
+    TIFFClose(t);
+    if (error != nullptr) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+// Overwrites the image region at row and column in existing file.
+static int update_region(io::WriteImageIn& val, WriteFunc writer,
+    ThreadPool& pool)
+{
+    int fd = open(val.filename().c_str(), O_RDWR);
+    if (fd < 0) {
+        std::cerr << "Failed to open: " << val.filename() << std::endl;
+        return 1;
+    }
+    ExistingLayout l;
+    int status = 1;
+    if (writer == &writePPM)
+        status = existing_netpbm(fd, "P6", l);
+    else if (writer == &writePGM)
+        status = existing_netpbm(fd, "P5", l);
+    else if (writer == &writePAM)
+        status = existing_netpbm(fd, "P7", l);
+#if !defined(NO_TIFF)
+    else if (writer == &writeTIFF)
+        status = existing_tiff(val.filename().c_str(), l);
+#endif
+    else
+        std::cerr << "In-place update not supported for format: "
+            << val.format() << std::endl;
+    const io::WriteImageIn::imageType& image(val.image());
+    const size_t row = val.rowGiven() ? val.row() : 0;
+    const size_t column = val.columnGiven() ? val.column() : 0;
+    if (status == 0) {
+        status = 1;
+        if (val.depthGiven() && val.depth() != l.depth)
+            std::cerr << "Depth " << val.depth()
+                << " does not match existing file depth " << l.depth << ".\n";
+        else if (image[0][0].size() != l.components)
+            std::cerr << "Got " << image[0][0].size()
+                << " color planes, existing file has " << l.components
+                << ".\n";
+        else if ((val.rowGiven() && val.row() < 0) ||
+            (val.columnGiven() && val.column() < 0) ||
+            l.height < row + image.size() || l.width < column + image[0].size())
+                std::cerr << "Region does not fit in existing image of "
+                    << l.width << " x " << l.height << ".\n";
+        else
+            status = 0;
+    }
+    if (status != 0) {
+        close(fd);
+        return status;
+    }
+    // Rows are split where they cross into the next chunk.
+    Quantizer q(val.minimum(), val.maximum(), l.depth);
+    const size_t pixel_size = l.pixel_size();
+    const size_t row_size = image[0].size() * pixel_size;
+    const size_t batch = std::min(batch_rows(row_size, pool), image.size());
+    std::vector<unsigned char> buf(batch * row_size);
+    std::vector<char> written(pool.Size(), 1);
+    for (size_t first = 0; first < image.size(); first += batch) {
+        size_t last = std::min(first + batch, image.size());
+        q.pack_rows(pool, l.pack, &buf.front(), row_size, image, first, last);
+        pool.Ranges(last - first, 16,
+            [&](size_t Part, size_t Begin, size_t End) {
+                for (size_t r = Begin; r < End && written[Part]; ++r) {
+                    const unsigned char* src = &buf[r * row_size];
+                    const size_t y = row + first + r;
+                    size_t x = column;
+                    const size_t x_end = column + image[0].size();
+                    while (x < x_end && written[Part]) {
+                        size_t end = std::min(x_end,
+                            (x / l.chunk_width + 1) * l.chunk_width);
+                        written[Part] = pwrite_all(fd,
+                            src + (x - column) * pixel_size,
+                            (end - x) * pixel_size, l.offset(y, x));
+                        x = end;
+                    }
+                }
+            });
+    }
+    bool ok = close(fd) == 0;
+    for (auto w : written)
+        ok = ok && w;
+    if (!ok) {
+        std::cerr << "Error writing to: " << val.filename() << std::endl;
+        return 2;
+    }
+    return 0;
+}
+
+// Digest of the image packed as it would be written and of the settings that
+// change the output. Rows are packed one at a time in parallel and their
+// digests are combined in order, so thread count does not change the result.
+static std::uint64_t image_digest(const io::WriteImageIn& val,
+    const Quantizer& q, ThreadPool& pool)
+{
+    const io::WriteImageIn::imageType& image(val.image());
+    const Quantizer::Packer pack =
+        (val.depth() == 8) ? &Quantizer::pack8 : &Quantizer::pack16be;
+    const size_t row_size =
+        image[0].size() * image[0][0].size() * ((val.depth() == 8) ? 1 : 2);
+    std::vector<std::uint64_t> digests(image.size() + 1);
+    std::vector<std::vector<unsigned char>> bufs(pool.Size());
+    pool.Ranges(image.size(), 16, [&](size_t Part, size_t Begin, size_t End) {
+        std::vector<unsigned char>& buf = bufs[Part];
+        buf.resize(row_size);
+        for (size_t r = Begin; r < End; ++r) {
+            (q.*pack)(buf.data(), image[r]);
+            digests[r] = digest(buf.data(), row_size);
+        }
+    });
+    std::stringstream settings;
+    settings << output_format(val) << ' ' << image[0].size() << ' '
+        << image.size() << ' ' << image[0][0].size() << ' ' << val.depth();
+    if (val.compressionGiven())
+        settings << " compression " << val.compression();
+    if (val.tileGiven())
+        settings << " tile " << val.tile();
+    if (val.levelsGiven())
+        settings << " levels " << val.levels();
+    if (val.profileGiven())
+        settings << " profile " << val.profile();
+    std::string text = settings.str();
+    std::transform(text.begin(), text.end(), text.begin(),
+        [](unsigned char c) { return std::tolower(c); });
+    digests.back() = digest(text.data(), text.size());
+    return digest(digests.data(), digests.size() * sizeof(std::uint64_t));
+}
+
+static int write_image(io::WriteImageIn& val) {
+    if (val.image().empty()) {
+        std::cerr << "Image has zero height.\n";
+        return 1;
+    }
+    if (val.image()[0].empty()) {
+        std::cerr << "Image has zero width.\n";
+        return 1;
+    }
+    if (val.image()[0][0].empty()) {
+        std::cerr << "Image has zero depth.\n";
+        return 1;
+    }
+    WriteFunc writer = nullptr;
+    if (check_format(val, val.image()[0][0].size(), writer))
+        return 1;
+    for (auto& line : val.image())
+        if (line.front().size() != val.image()[0][0].size()) {
+            std::cerr << "Color component count not constant, " <<
+                line.front().size() << " != " << val.image()[0][0].size() << "\n";
+            return 1;
+        }
+    WriteOptions options;
+    if (parse_options(val, options))
+        return 1;
+    ThreadPool pool((val.threadsGiven() && 0 < val.threads()) ?
+        static_cast<size_t>(val.threads()) : 0);
     // Find minimum and maximum, if at least one is missing.
     if (!val.minimumGiven() || !val.maximumGiven()) {
+        // Each part starts from the first value and parts are combined in
+        // order so the result matches a single pass.
+        std::vector<float> mins(pool.Size(), val.image()[0][0][0]);
+        std::vector<float> maxs(pool.Size(), val.image()[0][0][0]);
+        size_t parts = pool.Ranges(val.image().size(), 16,
+            [&](size_t Part, size_t Begin, size_t End) {
+                float mn = mins[Part], mx = maxs[Part];
+                for (size_t r = Begin; r < End; ++r)
+                    for (auto& pixel : val.image()[r])
+                        for (auto& component : pixel) {
+                            if (component < mn)
+                                mn = component;
+                            if (mx < component)
+                                mx = component;
+                        }
+                mins[Part] = mn;
+                maxs[Part] = mx;
+            });
         if (!val.minimumGiven())
             val.minimum() = val.image()[0][0][0];
         if (!val.maximumGiven())
             val.maximum() = val.image()[0][0][0];
-        for (auto& line : val.image())
-            for (auto& pixel : line)
-                for (auto& component : pixel) {
-                    if (!val.minimumGiven() && component < val.minimum())
-                        val.minimum() = component;
-                    if (!val.maximumGiven() && val.maximum() < component)
-                        val.maximum() = component;
-                }
+        for (size_t k = 0; k < parts; ++k) {
+            if (!val.minimumGiven() && mins[k] < val.minimum())
+                val.minimum() = mins[k];
+            if (!val.maximumGiven() && val.maximum() < maxs[k])
+                val.maximum() = maxs[k];
+        }
     }
-    // Limit values using minimum and maximum.
     float range = val.maximum() - val.minimum();
     if (range < 0) {
         std::cerr << "Maximum (" << val.maximum() << ") < minimum ("
             << val.minimum() << ").\n";
         return 1;
     }
-    for (auto& line : val.image()) {
-        if (line.front().size() != val.image()[0][0].size()) {
-            std::cerr << "Color component count not constant, " <<
-                line.front().size() << " != " << val.image()[0][0].size() << "\n";
+#if !defined(NO_TIFF)
+    if (options.tiff_append && writer != &writeTIFF) {
+        std::cerr << "Only TIFF pages can be appended.\n";
+        return 1;
+    }
+    // Other writes may be to the file open for appending.
+    if (!options.tiff_append)
+        tiff_pages.Close();
+#endif
+    // An earlier image may still be being written to the same file.
+    write_behind.Wait(val.filename());
+    // Digest of earlier output would not match after the file changes.
+    if (val.rowGiven() || val.columnGiven()) {
+        forget_digest(val.filename());
+        return update_region(val, writer, pool);
+    }
+    // Writers limit, scale and pack the values using minimum and maximum
+    // while filling their row buffers.
+    Quantizer q(val.minimum(), val.maximum(), val.depth());
+    bool skip = options.skip_unchanged;
+#if !defined(NO_TIFF)
+    skip = skip && !options.tiff_append;
+#endif
+    std::uint64_t value = 0;
+    if (skip) {
+        value = image_digest(val, q, pool);
+        if (digest_matches(val.filename(), value))
+            return 0;
+    }
+    forget_digest(val.filename());
+    int status =
+        writer(val.filename(), val.image(), val.depth(), q, pool, options);
+    if (status == 0 && skip) {
+        // Modification time is stored, so writing must have finished.
+        write_behind.Wait(val.filename());
+        store_digest(val.filename(), value);
+    }
+    return status;
+}
+
+// When minimum, maximum and a format with a row encoder are known before the
+// image, rows are encoded as they are parsed. Height is filled in last.
+
+class RowEncoder {
+public:
+    virtual ~RowEncoder() { }
+    // Encodes next rows. Returns false on error.
+    virtual bool Append(const io::WriteImageIn::imageType& Rows) = 0;
+    virtual bool Finish(size_t Height) = 0;
+};
+
+// Room for height in NetPBM headers, filled in with trailing spaces.
+static const std::string height_room(20, ' ');
+
+class NetpbmEncoder : public RowEncoder {
+private:
+    size_t file;
+    bool finished;
+    FileSink sink;
+    size_t height_at;
+    io::WriteImageIn::depthType depth;
+    bool plain;
+    const Quantizer& q;
+    ThreadPool& pool;
+    std::vector<unsigned char> buf;
+    std::vector<std::vector<char>> buffers;
+
+public:
+    NetpbmEncoder(size_t File, const std::string& Header,
+        io::WriteImageIn::depthType Depth, bool Plain, const Quantizer& Q,
+        ThreadPool& Pool)
+        : file(File), finished(false), sink(write_behind, File),
+        height_at(Header.rfind(height_room)), depth(Depth), plain(Plain),
+        q(Q), pool(Pool)
+    {
+        sink.Write(reinterpret_cast<const unsigned char*>(Header.data()),
+            Header.size());
+    }
+
+    ~NetpbmEncoder() {
+        if (!finished)
+            write_behind.Close(file);
+    }
+
+    bool Append(const io::WriteImageIn::imageType& Rows) {
+        if (plain)
+            return write_plain_rows(sink, Rows, q, pool, buffers);
+        return write_netpbm_rows(sink, Rows, depth, q, pool, buf);
+    }
+
+    bool Finish(size_t Height) {
+        std::string h = std::to_string(Height);
+        bool ok = sink.Flush() && sink.WriteAt(height_at,
+            reinterpret_cast<const unsigned char*>(h.data()), h.size());
+        write_behind.Close(file);
+        finished = true;
+        return ok;
+    }
+};
+
+#if !defined(NO_TIFF)
+// Writes strips as rows arrive. Rows that do not fill a strip are kept
+// until more arrive or the image ends. Strip count grows as strips are
+// written and image length is set at the end.
+class TIFFEncoder : public RowEncoder {
+private:
+    TIFF* t;
+    TIFFLayout layout;
+    std::uint16_t compression;
+    const Quantizer& q;
+    ThreadPool& pool;
+    std::vector<unsigned char> band;
+    size_t band_rows, filled, written;
+
+public:
+    TIFFEncoder(TIFF* T, const TIFFLayout& L, std::uint16_t Compression,
+        const Quantizer& Q, ThreadPool& Pool)
+        : t(T), layout(L), compression(Compression), q(Q), pool(Pool),
+        filled(0), written(0)
+    {
+        band_rows = layout.chunk_height * std::max(size_t(1),
+            batch_rows(layout.row_size(), pool) / layout.chunk_height);
+        band.resize(band_rows * layout.row_size());
+    }
+
+    ~TIFFEncoder() {
+        if (t)
+            TIFFClose(t);
+    }
+
+    bool Append(const io::WriteImageIn::imageType& Rows) {
+        for (size_t first = 0; first < Rows.size();) {
+            size_t count = std::min(band_rows - filled, Rows.size() - first);
+            q.pack_rows(pool,
+                (layout.depth == 8) ? &Quantizer::pack8 : &Quantizer::pack16,
+                &band[filled * layout.row_size()], layout.row_size(), Rows,
+                first, first + count);
+            first += count;
+            filled += count;
+            if (filled < band_rows)
+                continue;
+            if (!write_band(t, layout, &band.front(), written, filled,
+                compression, pool))
+                    return false;
+            written += filled;
+            filled = 0;
+        }
+        return true;
+    }
+
+    bool Finish(size_t Height) {
+        if (std::numeric_limits<std::uint32_t>::max() < Height) {
+            std::cerr << "Image too large for TIFF.\n";
+            return false;
+        }
+        if (0 < filled && !write_band(t, layout, &band.front(), written,
+            filled, compression, pool))
+                return false;
+        TIFFSetField(t, TIFFTAG_IMAGELENGTH, static_cast<std::uint32_t>(Height));
+        TIFFClose(t);
+        t = nullptr;
+        return true;
+    }
+};
+#endif
+
+#if !defined(NO_PNG)
+// Height in the header is replaced when the image ends.
+class PNGRowEncoder : public RowEncoder {
+private:
+    size_t file;
+    bool finished;
+    FileSink sink;
+    PNGEncoder enc;
+
+public:
+    PNGRowEncoder(size_t File, size_t Width, size_t Components,
+        io::WriteImageIn::depthType Depth, const Quantizer& Q,
+        ThreadPool& Pool, PNGProfile Profile)
+        : file(File), finished(false), sink(write_behind, File),
+        enc(sink, Width, 0, Components, Depth, Q, Pool, Profile)
+    { }
+
+    ~PNGRowEncoder() {
+        if (!finished)
+            write_behind.Close(file);
+    }
+
+    bool Append(const io::WriteImageIn::imageType& Rows) {
+        return enc.Append(Rows, 0, Rows.size());
+    }
+
+    bool Finish(size_t Height) {
+        bool ok = enc.Finish() && sink.Flush();
+        write_behind.Close(file);
+        finished = true;
+        return ok;
+    }
+};
+#endif
+
+class ImageStreamer : public StreamingInputParser<io::ParserPool,
+    io::WriteImageIn_Parser, io::WriteImageIn>::Handler
+{
+private:
+    io::WriteImageIn val;
+    size_t height;
+    std::unique_ptr<ThreadPool> pool;
+    std::unique_ptr<Quantizer> q;
+    std::unique_ptr<RowEncoder> encoder;
+
+    int discard(int Status) {
+        encoder.reset();
+        write_behind.Wait(val.filename());
+        unlink(val.filename().c_str());
+        return Status;
+    }
+
+    // Checks the image against format and creates the encoder.
+    int start(const io::WriteImageIn::imageType& Rows) {
+        if (Rows[0].empty()) {
+            std::cerr << "Image has zero width.\n";
             return 1;
         }
-        for (auto& pixel : line) {
-            for (auto& component : pixel) {
-                component -= val.minimum();
-                if (component <= 0.0f)
-                    component = 0.0f;
-                else if (range <= component)
-                    component = 1.0f;
-                else {
-                    component /= range;
-                    if (1.0f < component)
-                        component = 1.0f;
-                }
+        if (Rows[0][0].empty()) {
+            std::cerr << "Image has zero depth.\n";
+            return 1;
+        }
+        const size_t width = Rows[0].size();
+        const size_t components = Rows[0][0].size();
+        WriteFunc writer = nullptr;
+        WriteOptions options;
+        if (check_format(val, components, writer) ||
+            parse_options(val, options))
+                return 1;
+        if (val.maximum() - val.minimum() < 0) {
+            std::cerr << "Maximum (" << val.maximum() << ") < minimum ("
+                << val.minimum() << ").\n";
+            return 1;
+        }
+#if !defined(NO_TIFF)
+        // Begin leaves appended pages to the buffered path.
+        tiff_pages.Close();
+#endif
+        write_behind.Wait(val.filename());
+        forget_digest(val.filename());
+        pool.reset(new ThreadPool((val.threadsGiven() && 0 < val.threads()) ?
+            static_cast<size_t>(val.threads()) : 0));
+        q.reset(new Quantizer(val.minimum(), val.maximum(), val.depth()));
+#if !defined(NO_TIFF)
+        if (writer == &writeTIFF) {
+            if (std::numeric_limits<std::uint32_t>::max() < width) {
+                std::cerr << "Image too large for TIFF.\n";
+                return 1;
+            }
+            TIFFLayout layout = tiff_layout(width, 0, components, val.depth(), 0);
+            layout.height = layout.chunk_height;
+            // Height is not known, so size is not either.
+            TIFF* t = TIFFOpen(val.filename().c_str(), "w8");
+            if (!t) {
+                std::cerr << "Failed to open output file: " << val.filename()
+                    << std::endl;
+                return 1;
             }
+            set_tiff_fields(t, layout, options.tiff_compression);
+            encoder.reset(new TIFFEncoder(t, layout, options.tiff_compression,
+                *q, *pool));
+            return 0;
         }
+#endif
+#if !defined(NO_PNG)
+        size_t file;
+        if (!open_output(val.filename(), file))
+            return 1;
+        if (writer == &writePNG) {
+            encoder.reset(new PNGRowEncoder(file, width, components,
+                val.depth(), *q, *pool, options.png));
+            return 0;
+        }
+#else
+        size_t file;
+        if (!open_output(val.filename(), file))
+            return 1;
+#endif
+        std::string header;
+        if (writer == &writePAM)
+            header = pam_header(width, height_room, components, val.depth());
+        else
+            header = netpbm_header((writer == &writePPM) ? "P6" :
+                (writer == &writePGM) ? "P5" : "P3", width, height_room,
+                val.depth());
+        encoder.reset(new NetpbmEncoder(file, header, val.depth(),
+            writer == &writePlainPPM, *q, *pool));
+        return 0;
     }
+
+public:
+    ~ImageStreamer() {
+        // Input ended or had an error before the image was complete.
+        if (encoder)
+            discard(0);
+    }
+
+    bool Begin(io::WriteImageIn& Val) {
+        // Members after image could change the output, so streaming has to
+        // be asked for. Regions of existing files are updated from the whole
+        // image. The whole image is also needed for its digest.
+        if (!Val.streamGiven() || strcasecmp(Val.stream().c_str(), "yes") ||
+            !Val.minimumGiven() || !Val.maximumGiven() ||
+            Val.rowGiven() || Val.columnGiven() || (Val.unchangedGiven() &&
+                strcasecmp(Val.unchanged().c_str(), "skip") == 0))
+                    return false;
+        std::string format = output_format(Val);
+        const char* streamed[] = { "ppm", "p6-ppm", "p3-ppm", "pgm", "p5-pgm",
+            "pam", "p7-pam" };
+        bool stream = false;
+        for (auto name : streamed)
+            stream = stream || strcasecmp(format.c_str(), name) == 0;
+#if !defined(NO_PNG)
+        if (strcasecmp(format.c_str(), "png") == 0)
+            stream = true;
+#endif
 #if !defined(NO_TIFF)
-    if (tiff && val.image()[0][0].size() < 3)
-        val.depth() = 8; // Grayscale TIFF does not support 16-bit depth.
+        // Levels need the whole image. Tiles and appended pages are left
+        // for the buffered path.
+        if ((strcasecmp(format.c_str(), "tiff") == 0 ||
+            strcasecmp(format.c_str(), "tif") == 0) &&
+            !(Val.tileGiven() && 0 < Val.tile()) &&
+            !(Val.levelsGiven() && 0 < Val.levels()) &&
+            !(Val.existingGiven() &&
+                strcasecmp(Val.existing().c_str(), "append") == 0))
+                    stream = true;
 #endif
-    // Scale the components here since depth is known.
-    float max = 1 << val.depth();
-    for (auto& line : val.image())
-        for (auto& pixel : line)
-            for (auto& component : pixel) {
-                component = trunc(component * max);
-                if (component == max)
-                    component = max - 1;
-            }
-    try {
-        writer(val.filename(), val.image(), val.depth());
+        // Height is written last so output has to be a seekable file.
+        struct stat st;
+        if (!stream ||
+            (stat(Val.filename().c_str(), &st) == 0 && !S_ISREG(st.st_mode)))
+                return false;
+        std::swap(val, Val);
+        height = 0;
+        return true;
     }
-    catch (std::ofstream::failure f) {
-        unlink(val.filename().c_str());
-        std::cerr << f.code() << ' ' << f.what() << '\n';
-        return 2;
+
+    int Append(io::WriteImageIn::imageType& Batch) {
+        if (!encoder) {
+            int rv = start(Batch);
+            if (rv)
+                return rv;
+        }
+        if (!encoder->Append(Batch)) {
+            std::cerr << "Error writing to output: " << val.filename()
+                << std::endl;
+            return discard(2);
+        }
+        height += Batch.size();
+        return 0;
+    }
+
+    int End() {
+        if (!encoder) {
+            std::cerr << "Image has zero height.\n";
+            return 1;
+        }
+        if (!encoder->Finish(height)) {
+            std::cerr << "Error writing to output: " << val.filename()
+                << std::endl;
+            return discard(2);
+        }
+        encoder.reset();
+        return report_written(false);
     }
-    return 0;
-}
+
+    // Failures of earlier images found by now are reported before this one.
+    int Whole(io::WriteImageIn& Val) {
+        int status = report_written(false);
+        return status ? status : write_image(Val);
+    }
+};
 
 int main(int argc, char** argv) {
     int f = 0;
     if (argc > 1)
         f = open(argv[1], O_RDONLY);
-    InputParser<io::ParserPool, io::WriteImageIn_Parser, io::WriteImageIn>
-        ip(f);
-    int status = ip.ReadAndParse(write_image);
+    StreamingInputParser<io::ParserPool, io::WriteImageIn_Parser,
+        io::WriteImageIn> ip(f, "image");
+    int status;
+    {
+        ImageStreamer streamer;
+        status = ip.ReadAndParse(streamer);
+    }
     if (f)
         close(f);
-    return status;
+    // Images still being written when input ended.
+    int written = report_written(true);
+    return status ? status : written;
 }
@@ -14,16 +14,55 @@ RI=$6
 WI=$7
 
 rwimageinputgen -i readimage_io.pspec -w $W -h $H -c $C -d $D -f imagefile --format $F
-rwimageinputgen -i writeimage_io.pspec -w $W -h $H -c $C -d $D -f imagefile --format $F
+rwimageinputgen -i writeimage_io.pspec -w $W -h $H -c $C -d $D -f imagefile --format $F ${COMPRESSION:+--compression $COMPRESSION} ${TILE:+--tile $TILE} ${LEVELS:+--levels $LEVELS} ${RANGE:+--range} ${REGION:+--region $REGION} ${EXISTING:+--existing $EXISTING} ${UNCHANGED:+--unchanged $UNCHANGED} ${STREAM:+--stream $STREAM} ${LATE:+--late}
 rwimageinputgen -i split2planes_io.pspec -w $W -h $H -c $C -d $D -f imagefile --format $F
 
-$WI < writeimage_io.json
+if [ "$EXISTING" = "append" ]; then
+    # First page is read back after another is appended in the same run.
+    rm -f imagefile
+    cat writeimage_io.json writeimage_io.json | $WI || exit 1
+    if [ "$(tiffpages imagefile)" != "2" ]; then
+        echo "Appended page missing."
+        exit 1
+    fi
+    # Third page fails when the file can not grow. Earlier pages remain.
+    BLOCKS=$(( $(wc -c < imagefile) / 512 + 8 ))
+    if (trap '' XFSZ; ulimit -f $BLOCKS; $WI < writeimage_io.json); then
+        echo "Append past file size limit did not fail."
+        exit 1
+    fi
+    if [ "$(tiffpages imagefile)" != "2" ]; then
+        echo "Failed append changed pages."
+        exit 1
+    fi
+elif [ "$UNCHANGED" = "skip" ]; then
+    # Second write finds the stored digest and leaves the file as it is.
+    $WI < writeimage_io.json || exit 1
+    touch -r imagefile written
+    sleep 1
+    $WI < writeimage_io.json || exit 1
+    if [ imagefile -nt written ]; then
+        echo "Unchanged image was written again."
+        exit 1
+    fi
+    # Digest is not trusted after the file has been changed.
+    touch -t 200001010000 imagefile written
+    $WI < writeimage_io.json || exit 1
+    if [ ! imagefile -nt written ]; then
+        echo "Changed file was not written again."
+        exit 1
+    fi
+elif [ -z $REGION ]; then
+    $WI < writeimage_io.json
+else
+    $WI < writeimage_base.json && $WI < writeimage_region.json || exit 1
+fi
 $RI < readimage_io.json > out.json
 
 pixeldiff --reference writeimage_io.json --test out.json --depth $D
 STATUS=$?
 
 if [ -z $KEEP ]; then
-    rm -f imagefile writeimage_io.json readimage_io.json split2planes_io.json out.json
+    rm -f imagefile written writeimage_io.json writeimage_base.json writeimage_region.json readimage_io.json split2planes_io.json out.json
 fi
 exit $STATUS